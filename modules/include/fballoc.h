@@ -0,0 +1,96 @@
+#ifndef FBALLOC_H
+#define FBALLOC_H
+
+/*
+ * Backbuffer/shadow buffer allocation shared by the framebuffer drivers.
+ * Buffers are taken from physically contiguous frames and mapped with 4 MiB
+ * pages where possible, falling back to individually allocated 4 KiB pages.
+ */
+
+#include <kmod.h>
+#include <mm/vmm.h>
+#include <mm/pmm.h>
+#include <mm/addr.h>
+
+#define FBALLOC_HUGEPAGE            4194304 // size of a large page
+#define FBALLOC_FLAGS               (VMM_FLAGS_PRESENT | VMM_FLAGS_GLOBAL | VMM_FLAGS_CACHE | VMM_FLAGS_RW)
+
+/* maps frames [frame, frame + n) to a new kernel address, using large pages if they are 4 MiB aligned */
+static inline uintptr_t fballoc_map(size_t frame, size_t n) {
+    size_t size = n << 12;
+    bool huge = !((frame << 12) & (FBALLOC_HUGEPAGE - 1)) && !(size & (FBALLOC_HUGEPAGE - 1));
+    return vmm_alloc_map(vmm_kernel, frame << 12, size, kernel_end, UINTPTR_MAX, (huge) ? FBALLOC_HUGEPAGE : 0, (huge) ? 1 : 0, false, FBALLOC_FLAGS);
+}
+
+/* frees frames [frame, frame + n) */
+static inline void fballoc_free_frames(size_t frame, size_t n) {
+    for(size_t i = 0; i < n; i++) pmm_free(frame + i);
+}
+
+/* tries to allocate the buffer in one physically contiguous block */
+static inline void* fballoc_alloc_contig(size_t n) {
+    size_t huge_frames = FBALLOC_HUGEPAGE >> 12;
+    size_t frame = (size_t)-1;
+    if(!(n & (huge_frames - 1))) {
+        /* over-allocate so that a large page aligned run can be cut out, then give the slack back */
+        size_t block = pmm_alloc_free(n + huge_frames - 1);
+        if(block != (size_t)-1) {
+            frame = (block + huge_frames - 1) & ~(huge_frames - 1);
+            fballoc_free_frames(block, frame - block);
+            fballoc_free_frames(frame + n, block + huge_frames - 1 - frame);
+        }
+    }
+    if(frame == (size_t)-1) frame = pmm_alloc_free(n);
+    if(frame == (size_t)-1) return NULL;
+
+    uintptr_t buf = fballoc_map(frame, n);
+    if(!buf) {
+        fballoc_free_frames(frame, n);
+        return NULL;
+    }
+    return (void*) buf;
+}
+
+/* allocates the buffer page by page */
+static inline void* fballoc_alloc_pages(size_t n) {
+    uintptr_t buf = vmm_first_free(vmm_kernel, kernel_end, UINTPTR_MAX, n << 12, 0, false);
+    if(!buf) return NULL;
+    for(size_t i = 0; i < n; i++) {
+        size_t frame = pmm_alloc_free(1);
+        if(frame == (size_t)-1) {
+            /* roll back */
+            for(size_t j = 0; j < i; j++) {
+                pmm_free(vmm_get_paddr(vmm_kernel, buf + (j << 12)) >> 12);
+                vmm_pgunmap(vmm_kernel, buf + (j << 12), 0);
+            }
+            return NULL;
+        }
+        vmm_pgmap(vmm_kernel, frame << 12, buf + (i << 12), 0, FBALLOC_FLAGS);
+    }
+    return (void*) buf;
+}
+
+/*
+ * static inline void* fballoc_alloc(size_t size)
+ *  Allocates a kernel buffer of the specified size for use as a backbuffer.
+ *  Returns NULL (with nothing left allocated) on failure.
+ */
+static inline void* fballoc_alloc(size_t size) {
+    size_t n = (size + 4095) >> 12;
+    void* buf = fballoc_alloc_contig(n);
+    if(buf != NULL) kdebug("allocated %u contiguous frames for buffer at 0x%x", n, buf);
+    else buf = fballoc_alloc_pages(n);
+    return buf;
+}
+
+/*
+ * static inline void fballoc_free(void* buf, size_t size)
+ *  Frees a buffer allocated with fballoc_alloc.
+ */
+static inline void fballoc_free(void* buf, size_t size) {
+    size = (size + 4095) & ~4095;
+    for(size_t off = 0; off < size; off += 4096) pmm_free(vmm_get_paddr(vmm_kernel, (uintptr_t) buf + off) >> 12);
+    vmm_unmap(vmm_kernel, (uintptr_t) buf, size); // also takes care of large pages
+}
+
+#endif
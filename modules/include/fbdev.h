@@ -0,0 +1,369 @@
+#ifndef FBDEV_H
+#define FBDEV_H
+
+/*
+ * Userland framebuffer access shared by the framebuffer drivers:
+ *  - /dev/fbN: raw pixel data of the drawing buffer (backbuffer if there is one, framebuffer otherwise)
+ *  - /dev/fbNctl: reads return fbdev_info_t, writes take fbdev_cmd_t records
+ * Pixel conversion and fills use the format specialized kernels from fbpix.h.
+ */
+
+#include <kmod.h>
+#include <string.h>
+#include <stdio.h>
+#include <fs/devfs.h>
+#include <mm/vmm.h>
+#include <helpers/mutex.h>
+#include <hal/fbuf.h>
+#include <hal/timer.h>
+#include <fbpix.h>
+
+/* range of user virtual addresses that buffers are mapped into */
+#ifndef FBDEV_MAP_MIN
+#define FBDEV_MAP_MIN               0x40000000
+#endif
+#ifndef FBDEV_MAP_MAX
+#define FBDEV_MAP_MAX               0xBFFFFFFF
+#endif
+
+#define FBDEV_MAX_CLIENTS           16 // maximum number of processes that can have the nodes open at once
+
+/* control commands */
+#define FBDEV_CMD_DAMAGE            0 // report damaged rectangle (x, y, w, h) and update the screen
+#define FBDEV_CMD_FLIP              1 // flip the entire backbuffer
+#define FBDEV_CMD_MAP               2 // map the drawing buffer into the calling process (address is returned in fbdev_info_t.map_addr) - fails if the drawing buffer can move
+#define FBDEV_CMD_FILL              3 // fill rectangle (x, y, w, h) with xRGB8888 color
+#define FBDEV_CMD_FORMAT            4 // set pixel format for writes to /dev/fbN (color: FBDEV_FORMAT_*)
+
+/* write formats */
+#define FBDEV_FORMAT_NATIVE         0 // raw framebuffer format
+#define FBDEV_FORMAT_XRGB8888       1 // xRGB8888 pixels, converted on write (offsets are in xRGB8888 units too)
+
+/* info flags */
+#define FBDEV_INFO_BACKBUFFER       (1 << 0) // drawing happens in a backbuffer and must be flipped
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t pitch; // bytes per line
+    uint32_t bpp;
+    uint32_t type; // FBUF_* pixel format
+    uint32_t flags; // FBDEV_INFO_*
+    uint32_t size; // size of the drawing buffer in bytes
+    uint32_t map_addr; // address of the calling process's FBDEV_CMD_MAP mapping (0 if none)
+    uint32_t flip_rate; // bytes written to video memory by flips per second, measured over the last second or more
+} __attribute__((packed)) fbdev_info_t;
+
+typedef struct {
+    uint32_t cmd; // FBDEV_CMD_*
+    uint32_t x, y, w, h; // for FBDEV_CMD_DAMAGE and FBDEV_CMD_FILL
+    uint32_t color; // for FBDEV_CMD_FILL and FBDEV_CMD_FORMAT
+} __attribute__((packed)) fbdev_cmd_t;
+
+/*
+ * processes (address spaces) that have the nodes open - devfs callbacks only get the node, so mappings are tracked
+ * per address space. A mapping is only ever removed from within its own address space (on MAP or the last close),
+ * since another process's address space may be gone by the time we get to it; the driver cannot unload while any
+ * mapping exists, as that would hand the frames behind it back to the PMM.
+ */
+typedef struct {
+    void* vmm; // NULL = free entry
+    uintptr_t map_addr; // 0 if the buffer is not mapped
+    size_t map_size;
+    uintptr_t map_paddr; // physical address of the first mapped page (to tell our mapping apart from a reused address space's)
+    size_t opens; // number of times the process has either node open
+} fbdev_client_t;
+
+static fbuf_t* fbdev_impl = NULL; // NULL once the driver has been unloaded
+static vfs_node_t* fbdev_node = NULL;
+static vfs_node_t* fbdev_ctl_node = NULL;
+static fbdev_client_t fbdev_clients[FBDEV_MAX_CLIENTS]; // protected by fbdev_clients_lock
+static mutex_t fbdev_clients_lock;
+static const fbpix_ops_t* fbdev_pix = NULL; // pixel kernels for the current mode
+static uint32_t fbdev_format = FBDEV_FORMAT_NATIVE;
+
+/* flip traffic accounting */
+static uint64_t fbdev_flip_bytes = 0; // bytes flipped since fbdev_flip_tick
+static timer_tick_t fbdev_flip_tick = 0; // start of the current measurement window
+static uint32_t fbdev_flip_rate = 0; // result of the last completed window
+
+static inline void* fbdev_buffer() {
+    return (fbdev_impl->backbuffer != NULL) ? fbdev_impl->backbuffer : fbdev_impl->framebuffer;
+}
+
+static inline size_t fbdev_size() {
+    return fbdev_impl->pitch * fbdev_impl->height;
+}
+
+static inline uint32_t fbdev_bpp(uint8_t type) {
+    switch(type) {
+        case FBUF_15BPP_RGB555: return 15;
+        case FBUF_16BPP_RGB565: return 16;
+        case FBUF_24BPP_BGR888: return 24;
+        default: return 32;
+    }
+}
+
+/* FRAMEBUFFER DATA NODE */
+
+static uint64_t fbdev_read(vfs_node_t* node, uint64_t offset, uint64_t size, uint8_t* buf) {
+    (void) node;
+    if(fbdev_impl == NULL || offset >= fbdev_size()) return 0;
+    if(offset + size > fbdev_size()) size = fbdev_size() - offset;
+    memcpy(buf, (uint8_t*) fbdev_buffer() + offset, size);
+    return size;
+}
+
+/* converts xRGB8888 data into the drawing buffer line by line */
+static uint64_t fbdev_write_xrgb(uint64_t offset, uint64_t size, const uint8_t* buf) {
+    size_t src_pitch = fbdev_impl->width * 4;
+    if((offset & 3) || offset >= src_pitch * fbdev_impl->height) return 0;
+    size &= ~3ULL;
+    if(offset + size > src_pitch * fbdev_impl->height) size = src_pitch * fbdev_impl->height - offset;
+
+    size_t done = 0;
+    while(done < size) {
+        size_t y = (offset + done) / src_pitch, x = ((offset + done) % src_pitch) / 4;
+        size_t count = fbdev_impl->width - x;
+        if(count > (size - done) / 4) count = (size - done) / 4;
+        fbdev_pix->convert((uint8_t*) fbdev_buffer() + y * fbdev_impl->pitch + x * fbdev_pix->bytes, (const uint32_t*) &buf[done], count);
+        done += count * 4;
+    }
+    return size;
+}
+
+static uint64_t fbdev_write(vfs_node_t* node, uint64_t offset, uint64_t size, const uint8_t* buf) {
+    (void) node;
+    if(fbdev_impl == NULL) return 0;
+    if(fbdev_format == FBDEV_FORMAT_XRGB8888) return fbdev_write_xrgb(offset, size, buf);
+    if(offset >= fbdev_size()) return 0;
+    if(offset + size > fbdev_size()) size = fbdev_size() - offset;
+    memcpy((uint8_t*) fbdev_buffer() + offset, buf, size);
+    return size;
+}
+
+/* returns the calling process's entry (fbdev_clients_lock must be held) */
+static fbdev_client_t* fbdev_client() {
+    for(size_t i = 0; i < FBDEV_MAX_CLIENTS; i++) {
+        if(fbdev_clients[i].vmm == vmm_current) return &fbdev_clients[i];
+    }
+    return NULL;
+}
+
+/* removes the calling process's mapping of the drawing buffer, if there's one (fbdev_clients_lock must be held) */
+static void fbdev_client_unmap(fbdev_client_t* client) {
+    if(!client->map_addr) return;
+    kassert(client->vmm == vmm_current);
+    if((vmm_get_paddr(client->vmm, client->map_addr) & ~4095) == client->map_paddr)
+        vmm_unmap(client->vmm, client->map_addr, client->map_size); // the frames stay with the driver
+    else kdebug("stale framebuffer mapping at 0x%x (address space has been reused) - not unmapping", client->map_addr);
+    client->map_addr = 0; client->map_size = 0; client->map_paddr = 0;
+}
+
+static bool fbdev_open(vfs_node_t* node, bool read, bool write) {
+    (void) read; (void) write;
+    if(fbdev_impl == NULL) return false;
+    mutex_acquire(&fbdev_clients_lock);
+    fbdev_client_t* client = fbdev_client();
+    if(client == NULL) {
+        for(size_t i = 0; i < FBDEV_MAX_CLIENTS; i++) {
+            if(fbdev_clients[i].vmm == NULL) {
+                client = &fbdev_clients[i];
+                memset(client, 0, sizeof(fbdev_client_t));
+                client->vmm = vmm_current;
+                break;
+            }
+        }
+    }
+    if(client != NULL) client->opens++;
+    mutex_release(&fbdev_clients_lock);
+    if(client == NULL) kwarn("too many processes have %s open", node->name);
+    return (client != NULL);
+}
+
+static void fbdev_close(vfs_node_t* node) {
+    (void) node;
+    mutex_acquire(&fbdev_clients_lock);
+    fbdev_client_t* client = fbdev_client();
+    if(client != NULL && --client->opens == 0) {
+        fbdev_client_unmap(client);
+        client->vmm = NULL;
+    }
+    mutex_release(&fbdev_clients_lock);
+}
+
+/* CONTROL NODE */
+
+/*
+ * a mapping stays valid only as long as the drawing buffer stays where it is: drivers keep their backbuffer in place
+ * (page flipping included), but without one, hardware scrolling moves the framebuffer pointer around in VRAM
+ */
+static inline bool fbdev_buffer_fixed() {
+    return (fbdev_impl->backbuffer != NULL || (fbdev_impl->scroll_up == NULL && fbdev_impl->scroll_down == NULL));
+}
+
+/* maps the drawing buffer into the calling process page by page (the backbuffer is not necessarily physically contiguous), replacing any previous mapping */
+static bool fbdev_map() {
+    if(!fbdev_buffer_fixed()) {
+        kwarn("framebuffer moves on scrolling - refusing to map it");
+        return false;
+    }
+    mutex_acquire(&fbdev_clients_lock);
+    fbdev_client_t* client = fbdev_client();
+    if(client == NULL) {
+        mutex_release(&fbdev_clients_lock);
+        return false;
+    }
+    fbdev_client_unmap(client);
+
+    size_t size = (fbdev_size() + 4095) & ~4095;
+    uintptr_t buf = (uintptr_t) fbdev_buffer();
+    uintptr_t vaddr = vmm_first_free(client->vmm, FBDEV_MAP_MIN, FBDEV_MAP_MAX, size, 0, true);
+    if(!vaddr) {
+        mutex_release(&fbdev_clients_lock);
+        kerror("cannot find user address space to map framebuffer to");
+        return false;
+    }
+    for(size_t off = 0; off < size; off += 4096) vmm_pgmap(client->vmm, vmm_get_paddr(vmm_kernel, buf + off) & ~4095, vaddr + off, 0, VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_USER | VMM_FLAGS_CACHE);
+    client->map_addr = vaddr; client->map_size = size; client->map_paddr = vmm_get_paddr(vmm_kernel, buf) & ~4095;
+    mutex_release(&fbdev_clients_lock);
+    return true;
+}
+
+/* returns the calling process's mapping address (0 if none) */
+static uintptr_t fbdev_map_addr() {
+    mutex_acquire(&fbdev_clients_lock);
+    fbdev_client_t* client = fbdev_client();
+    uintptr_t addr = (client != NULL) ? client->map_addr : 0;
+    mutex_release(&fbdev_clients_lock);
+    return addr;
+}
+
+/* returns the flip rate, closing the current measurement window if it has run its course without a flip to do so */
+static uint32_t fbdev_flip_rate_get() {
+    timer_tick_t elapsed = timer_tick - fbdev_flip_tick;
+    if(elapsed >= 1000000UL) return fbdev_flip_bytes * 1000000ULL / elapsed; // flips have slowed down or stopped
+    return fbdev_flip_rate;
+}
+
+static uint64_t fbdev_ctl_read(vfs_node_t* node, uint64_t offset, uint64_t size, uint8_t* buf) {
+    (void) node;
+    if(fbdev_impl == NULL || offset >= sizeof(fbdev_info_t)) return 0;
+    fbdev_info_t info = {
+        .width = fbdev_impl->width, .height = fbdev_impl->height, .pitch = fbdev_impl->pitch,
+        .bpp = fbdev_bpp(fbdev_impl->type), .type = fbdev_impl->type,
+        .flags = (fbdev_impl->backbuffer != NULL) ? FBDEV_INFO_BACKBUFFER : 0,
+        .size = fbdev_size(), .map_addr = fbdev_map_addr(),
+        .flip_rate = fbdev_flip_rate_get()
+    };
+    if(offset + size > sizeof(fbdev_info_t)) size = sizeof(fbdev_info_t) - offset;
+    memcpy(buf, (uint8_t*) &info + offset, size);
+    return size;
+}
+
+static uint64_t fbdev_ctl_write(vfs_node_t* node, uint64_t offset, uint64_t size, const uint8_t* buf) {
+    (void) node; (void) offset;
+    if(fbdev_impl == NULL) return 0;
+    size_t done = 0;
+    for(; done + sizeof(fbdev_cmd_t) <= size; done += sizeof(fbdev_cmd_t)) {
+        fbdev_cmd_t cmd; memcpy(&cmd, &buf[done], sizeof(fbdev_cmd_t));
+        switch(cmd.cmd) {
+            case FBDEV_CMD_DAMAGE: // flip handlers find damaged spans themselves, so this is the same as a flip for now
+            case FBDEV_CMD_FLIP:
+                if(fbdev_impl->flip != NULL) fbdev_impl->flip(fbdev_impl);
+                break;
+            case FBDEV_CMD_MAP:
+                if(!fbdev_map()) return done; // stop here
+                break;
+            case FBDEV_CMD_FILL:
+                if(cmd.x >= fbdev_impl->width || cmd.y >= fbdev_impl->height) break;
+                if(cmd.w > fbdev_impl->width - cmd.x) cmd.w = fbdev_impl->width - cmd.x;
+                if(cmd.h > fbdev_impl->height - cmd.y) cmd.h = fbdev_impl->height - cmd.y;
+                fbdev_pix->fill((uint8_t*) fbdev_buffer() + cmd.y * fbdev_impl->pitch + cmd.x * fbdev_pix->bytes, fbdev_impl->pitch, cmd.w, cmd.h, cmd.color);
+                break;
+            case FBDEV_CMD_FORMAT:
+                if(cmd.color > FBDEV_FORMAT_XRGB8888) return done;
+                fbdev_format = cmd.color;
+                break;
+            default:
+                kwarn("unknown framebuffer control command %u", cmd.cmd);
+                return done;
+        }
+    }
+    return done;
+}
+
+/*
+ * static inline void fbdev_flip_account(size_t bytes)
+ *  Records the number of bytes a flip has written to video memory.
+ *  Called by flip handlers; the rate is recalculated about once per second.
+ */
+static inline void fbdev_flip_account(size_t bytes) {
+    fbdev_flip_bytes += bytes;
+    timer_tick_t elapsed = timer_tick - fbdev_flip_tick;
+    if(elapsed >= 1000000UL) {
+        fbdev_flip_rate = fbdev_flip_bytes * 1000000ULL / elapsed;
+        fbdev_flip_bytes = 0; fbdev_flip_tick += elapsed;
+    }
+}
+
+/*
+ * static bool fbdev_register(fbuf_t* impl)
+ *  Creates the /dev/fbN and /dev/fbNctl nodes for the specified framebuffer implementation.
+ */
+static bool fbdev_register(fbuf_t* impl) {
+    vfs_node_t* devfs_root = vfs_traverse_path(NULL, "/dev");
+    if(devfs_root == NULL) {
+        kerror("cannot find devfs root");
+        return false;
+    }
+
+    fbdev_impl = impl;
+    fbdev_pix = fbpix_select(impl->type); // chosen once per mode
+    fbdev_flip_tick = timer_tick;
+    char name[16], ctl_name[16];
+    for(size_t i = 0; i < 16; i++) {
+        ksprintf(name, "fb%u", i);
+        if(vfs_finddir(devfs_root, name) == NULL) {
+            ksprintf(ctl_name, "fb%uctl", i);
+            fbdev_node = devfs_create(devfs_root, &fbdev_read, &fbdev_write, &fbdev_open, &fbdev_close, NULL, false, fbdev_size(), name);
+            if(fbdev_node == NULL) break;
+            fbdev_ctl_node = devfs_create(devfs_root, &fbdev_ctl_read, &fbdev_ctl_write, &fbdev_open, &fbdev_close, NULL, false, sizeof(fbdev_info_t), ctl_name);
+            if(fbdev_ctl_node == NULL) {
+                devfs_remove(fbdev_node); fbdev_node = NULL;
+                break;
+            }
+            kdebug("framebuffer is available as /dev/%s", name);
+            return true;
+        }
+    }
+
+    kerror("cannot create framebuffer devfs nodes");
+    return false;
+}
+
+/*
+ * static bool fbdev_unregister()
+ *  Removes the framebuffer nodes so that the driver can free its buffers (e.g. before unloading).
+ *  Returns false, leaving everything in place, if a process still has the drawing buffer mapped.
+ */
+static bool fbdev_unregister() {
+    mutex_acquire(&fbdev_clients_lock);
+    for(size_t i = 0; i < FBDEV_MAX_CLIENTS; i++) {
+        if(fbdev_clients[i].vmm != NULL && fbdev_clients[i].map_addr) {
+            mutex_release(&fbdev_clients_lock);
+            kwarn("framebuffer is still mapped into a process - cannot unregister");
+            return false;
+        }
+    }
+    fbdev_impl = NULL; // fail any further accesses through nodes that are still open
+    mutex_release(&fbdev_clients_lock);
+
+    if(fbdev_node != NULL) devfs_remove(fbdev_node);
+    if(fbdev_ctl_node != NULL) devfs_remove(fbdev_ctl_node);
+    fbdev_node = NULL; fbdev_ctl_node = NULL;
+    fbdev_flip_bytes = 0; fbdev_flip_rate = 0;
+    return true;
+}
+
+#endif
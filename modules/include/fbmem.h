@@ -0,0 +1,120 @@
+#ifndef FBMEM_H
+#define FBMEM_H
+
+/*
+ * Framebuffer memory copy/fill/compare kernels shared by the framebuffer drivers.
+ * Call fbmem_init() once before using any of the *_vram functions; until then
+ * (or if the CPU lacks SSE2) they fall back to rep movsl/stosl.
+ * Exactly one source file per module must define FBMEM_IMPL before including
+ * this header, so that the CPU feature flags are defined once.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern bool fbmem_nt; // set if non-temporal stores (MOVNTI, SSE2) are available
+#ifdef FBMEM_IMPL
+bool fbmem_nt = false;
+#endif
+
+/*
+ * static inline void fbmem_init()
+ *  Selects the kernels to be used based on CPUID.
+ */
+static inline void fbmem_init() {
+    /* check for CPUID support (ID flag in EFLAGS must be toggleable) */
+    uint32_t flags_old, flags_new;
+    asm volatile("pushf; pop %0; mov %0, %1; xor $0x200000, %1; push %1; popf; pushf; pop %1; push %0; popf" : "=&r"(flags_old), "=&r"(flags_new));
+    if(!((flags_old ^ flags_new) & 0x200000)) return;
+
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    fbmem_nt = (edx & (1 << 26)); // SSE2
+}
+
+/* copies dwords with rep movsl - count is in dwords */
+static inline void fbmem_movsl(void* dst, const void* src, size_t count) {
+    asm volatile("cld; rep movsl" : "+D"(dst), "+S"(src), "+c"(count) : : "memory");
+}
+
+/* copies dwords with non-temporal stores, bypassing the cache - count is in dwords */
+static inline void fbmem_movnti(void* dst, const void* src, size_t count) {
+    uint32_t* d = dst; const uint32_t* s = src;
+    for(; count >= 4; count -= 4, d += 4, s += 4) {
+        /* only general purpose registers are used, as the kernel does not save FPU/SSE state for us */
+        uint32_t a = s[0], b = s[1], c = s[2], e = s[3];
+        asm volatile("movnti %1, %0" : "=m"(d[0]) : "r"(a));
+        asm volatile("movnti %1, %0" : "=m"(d[1]) : "r"(b));
+        asm volatile("movnti %1, %0" : "=m"(d[2]) : "r"(c));
+        asm volatile("movnti %1, %0" : "=m"(d[3]) : "r"(e));
+    }
+    for(; count > 0; count--, d++, s++) asm volatile("movnti %1, %0" : "=m"(*d) : "r"(*s));
+    asm volatile("sfence" : : : "memory"); // make non-temporal stores globally visible
+}
+
+/*
+ * static inline void fbmem_copy_vram(void* dst, const void* src, size_t len)
+ *  Copies data into video memory (or anywhere else it won't be read back from soon).
+ *  The regions may overlap as long as dst is below src.
+ */
+static inline void fbmem_copy_vram(void* dst, const void* src, size_t len) {
+    if(fbmem_nt && !((uintptr_t) dst & 3)) fbmem_movnti(dst, src, len >> 2);
+    else fbmem_movsl(dst, src, len >> 2);
+    if(len & 3) memmove((uint8_t*) dst + (len & ~3), (const uint8_t*) src + (len & ~3), len & 3);
+}
+
+/*
+ * static inline void fbmem_move_vram(void* dst, const void* src, size_t len)
+ *  Moves overlapping data around in video memory.
+ */
+static inline void fbmem_move_vram(void* dst, const void* src, size_t len) {
+    if((uintptr_t) dst <= (uintptr_t) src) fbmem_copy_vram(dst, src, len); // forward copy is safe
+    else memmove(dst, src, len);
+}
+
+/*
+ * static inline void fbmem_fill32(void* dst, uint32_t val, size_t count)
+ *  Fills memory with the specified dword (count is in dwords).
+ */
+static inline void fbmem_fill32(void* dst, uint32_t val, size_t count) {
+    asm volatile("cld; rep stosl" : "+D"(dst), "+c"(count) : "a"(val) : "memory");
+}
+
+/*
+ * static inline void fbmem_fill32_vram(void* dst, uint32_t val, size_t count)
+ *  Fills video memory with the specified dword (count is in dwords).
+ */
+static inline void fbmem_fill32_vram(void* dst, uint32_t val, size_t count) {
+    if(!fbmem_nt) {
+        fbmem_fill32(dst, val, count);
+        return;
+    }
+    uint32_t* d = dst;
+    for(; count > 0; count--, d++) asm volatile("movnti %1, %0" : "=m"(*d) : "r"(val));
+    asm volatile("sfence" : : : "memory");
+}
+
+/*
+ * static inline bool fbmem_diff32(const void* a, const void* b, size_t count, size_t* first, size_t* last)
+ *  Finds the first and last (exclusive) differing dwords between two buffers.
+ *  Returns false if the buffers are identical.
+ */
+static inline bool fbmem_diff32(const void* a, const void* b, size_t count, size_t* first, size_t* last) {
+    const uint32_t* pa = a; const uint32_t* pb = b;
+    if(count == 0) return false;
+    size_t left = count;
+    asm volatile("cld; repe cmpsl" : "+S"(pa), "+D"(pb), "+c"(left) : : "memory", "cc");
+    if(left == 0 && pa[-1] == pb[-1]) return false; // ran off the end without a mismatch
+    *first = count - left - 1; // cmpsl stops after the mismatching dword
+
+    /* scan backwards in C (std would leave DF set for interrupt handlers) */
+    const uint32_t* ea = a; const uint32_t* eb = b;
+    size_t end = count;
+    while(end > *first + 1 && ea[end - 1] == eb[end - 1]) end--;
+    *last = end;
+    return true;
+}
+
+#endif
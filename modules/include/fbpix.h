@@ -0,0 +1,85 @@
+#ifndef FBPIX_H
+#define FBPIX_H
+
+/*
+ * Pixel format specialized fill/convert kernels, generated once per framebuffer
+ * format so that no per-pixel format switch happens on the hot path.
+ * Source colors are always xRGB8888 (0x00RRGGBB).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <hal/fbuf.h>
+
+typedef struct {
+    uint8_t bytes; // bytes per pixel
+    void (*fill)(void* dst, size_t pitch, size_t w, size_t h, uint32_t color); // fill rectangle starting at dst
+    void (*convert)(void* dst, const uint32_t* src, size_t count); // convert count xRGB8888 pixels
+} fbpix_ops_t;
+
+/* packing of an xRGB8888 color into each format */
+#define FBPIX_PACK_RGB555(c)        ((((c) >> 9) & 0x7C00) | (((c) >> 6) & 0x03E0) | (((c) >> 3) & 0x001F))
+#define FBPIX_PACK_RGB565(c)        ((((c) >> 8) & 0xF800) | (((c) >> 5) & 0x07E0) | (((c) >> 3) & 0x001F))
+#define FBPIX_PACK_RGB888(c)        ((c) & 0x00FFFFFF)
+
+/* generates kernels for formats whose pixels fit into a native integer type */
+#define FBPIX_DEFINE_INT(name, type, pack) \
+    static void fbpix_fill_##name(void* dst, size_t pitch, size_t w, size_t h, uint32_t color) { \
+        type px = (type) pack(color); \
+        for(size_t y = 0; y < h; y++) { \
+            type* line = (type*) ((uint8_t*) dst + y * pitch); \
+            for(size_t x = 0; x < w; x++) line[x] = px; \
+        } \
+    } \
+    static void fbpix_convert_##name(void* dst, const uint32_t* src, size_t count) { \
+        type* d = dst; \
+        for(size_t i = 0; i < count; i++) d[i] = (type) pack(src[i]); \
+    } \
+    static const fbpix_ops_t fbpix_ops_##name = {sizeof(type), &fbpix_fill_##name, &fbpix_convert_##name};
+
+FBPIX_DEFINE_INT(rgb555, uint16_t, FBPIX_PACK_RGB555)
+FBPIX_DEFINE_INT(rgb565, uint16_t, FBPIX_PACK_RGB565)
+FBPIX_DEFINE_INT(rgb888, uint32_t, FBPIX_PACK_RGB888)
+
+/* 24bpp pixels are stored as 3 bytes (B, G, R) and need their own kernels */
+static void fbpix_fill_bgr888(void* dst, size_t pitch, size_t w, size_t h, uint32_t color) {
+    uint8_t b = color, g = color >> 8, r = color >> 16;
+    for(size_t y = 0; y < h; y++) {
+        uint8_t* line = (uint8_t*) dst + y * pitch;
+        for(size_t x = 0; x < w; x++, line += 3) {
+            line[0] = b; line[1] = g; line[2] = r;
+        }
+    }
+}
+
+/* packs 4 pixels into 3 dwords per iteration - general purpose registers only, as the kernel does not save FPU/SSE state */
+static void fbpix_convert_bgr888(void* dst, const uint32_t* src, size_t count) {
+    uint32_t* d = dst;
+    for(; count >= 4; count -= 4, src += 4, d += 3) {
+        uint32_t p0 = src[0] & 0xFFFFFF, p1 = src[1] & 0xFFFFFF, p2 = src[2] & 0xFFFFFF, p3 = src[3] & 0xFFFFFF;
+        d[0] = p0 | (p1 << 24); // B0 G0 R0 B1
+        d[1] = (p1 >> 8) | (p2 << 16); // G1 R1 B2 G2
+        d[2] = (p2 >> 16) | (p3 << 8); // R2 B3 G3 R3
+    }
+    uint8_t* b = (uint8_t*) d;
+    for(; count > 0; count--, src++, b += 3) {
+        b[0] = *src; b[1] = *src >> 8; b[2] = *src >> 16;
+    }
+}
+
+static const fbpix_ops_t fbpix_ops_bgr888 = {3, &fbpix_fill_bgr888, &fbpix_convert_bgr888};
+
+/*
+ * static inline const fbpix_ops_t* fbpix_select(uint8_t type)
+ *  Returns the kernels for the specified FBUF_* pixel format.
+ */
+static inline const fbpix_ops_t* fbpix_select(uint8_t type) {
+    switch(type) {
+        case FBUF_15BPP_RGB555: return &fbpix_ops_rgb555;
+        case FBUF_16BPP_RGB565: return &fbpix_ops_rgb565;
+        case FBUF_24BPP_BGR888: return &fbpix_ops_bgr888;
+        default: return &fbpix_ops_rgb888;
+    }
+}
+
+#endif
@@ -0,0 +1,131 @@
+#include "cmd.h"
+#include <string.h>
+#include <exec/task.h>
+
+#include "ps2_io.h"
+
+_Static_assert((PS2_CMD_QUEUE_LEN & (PS2_CMD_QUEUE_LEN - 1)) == 0, "PS2_CMD_QUEUE_LEN must be a power of two");
+
+struct ps2_cmd_queue {
+    ps2_cmd_t* cmds[PS2_CMD_QUEUE_LEN];
+    uint8_t head, tail; // free-running indices; head is the command in flight
+    size_t resends;
+    size_t timeouts;
+};
+static struct ps2_cmd_queue ps2_cmd_queues[2];
+
+void ps2_cmd_init(ps2_cmd_t* cmd, uint8_t port, const uint8_t* data, size_t len, size_t resp_min, size_t resp_max, timer_tick_t timeout) {
+    memset(cmd, 0, sizeof(ps2_cmd_t));
+    cmd->port = port;
+    memcpy(cmd->data, data, len); cmd->len = len;
+    cmd->resp_min = resp_min; cmd->resp_max = resp_max;
+    cmd->timeout = timeout;
+}
+
+/* sends the current byte of the command at the head of the queue (interrupts must be disabled) */
+static void ps2_cmd_send_current(ps2_cmd_t* cmd) {
+    cmd->state = PS2_CMD_AWAIT_ACK;
+    cmd->tick_sent = timer_tick;
+    ps2_send_data(cmd->port, cmd->data[cmd->idx]);
+}
+
+/* completes the command at the head of the queue and starts the next one (interrupts must be disabled) */
+static void ps2_cmd_complete(ps2_cmd_t* cmd, uint8_t state) {
+    struct ps2_cmd_queue* q = &ps2_cmd_queues[cmd->port];
+    q->head++;
+    __atomic_store_n(&cmd->state, state, __ATOMIC_RELEASE); // cmd may be reused by its owner from here on
+    if(q->head != q->tail) ps2_cmd_send_current(q->cmds[q->head % PS2_CMD_QUEUE_LEN]);
+}
+
+bool ps2_cmd_submit(ps2_cmd_t* cmd) {
+    struct ps2_cmd_queue* q = &ps2_cmd_queues[cmd->port];
+
+    uintptr_t flags = ps2_irq_save();
+    if((uint8_t) (q->tail - q->head) >= PS2_CMD_QUEUE_LEN) {
+        ps2_irq_restore(flags);
+        return false; // cmd is left untouched, so a previously completed command still reads as completed
+    }
+    cmd->state = PS2_CMD_QUEUED; cmd->idx = 0; cmd->resp_cnt = 0; cmd->retries = 0; // only once the slot is ours
+    q->cmds[q->tail++ % PS2_CMD_QUEUE_LEN] = cmd;
+    if((uint8_t) (q->tail - q->head) == 1) ps2_cmd_send_current(cmd); // port was idle
+    ps2_irq_restore(flags);
+    return true;
+}
+
+bool ps2_cmd_wait(ps2_cmd_t* cmd) {
+    while(__atomic_load_n(&cmd->state, __ATOMIC_ACQUIRE) < PS2_CMD_DONE) {
+        ps2_cmd_poll(cmd->port);
+        task_yield_noirq();
+    }
+    return (cmd->state == PS2_CMD_DONE);
+}
+
+bool ps2_cmd_handle_byte(uint8_t port, uint8_t data) {
+    struct ps2_cmd_queue* q = &ps2_cmd_queues[port];
+    if(q->head == q->tail) return false; // nothing in flight
+    ps2_cmd_t* cmd = q->cmds[q->head % PS2_CMD_QUEUE_LEN];
+
+    switch(cmd->state) {
+        case PS2_CMD_AWAIT_ACK:
+            if(data == PS2_DEVRESP_ACK) {
+                cmd->retries = 0;
+                if(++cmd->idx < cmd->len) ps2_cmd_send_current(cmd); // next byte
+                else if(cmd->resp_cnt >= cmd->resp_max) ps2_cmd_complete(cmd, PS2_CMD_DONE);
+                else {
+                    cmd->state = PS2_CMD_AWAIT_RESP;
+                    cmd->tick_sent = timer_tick;
+                }
+                return true;
+            }
+            if(data == PS2_DEVRESP_RESEND) {
+                q->resends++;
+                if(++cmd->retries > PS2_DATA_RETRIES) ps2_cmd_complete(cmd, PS2_CMD_FAILED);
+                else ps2_cmd_send_current(cmd);
+                return true;
+            }
+            if(cmd->idx == cmd->len - 1 && cmd->resp_cnt < cmd->resp_max) {
+                /* some devices send their response before ACKing the last byte (e.g. BAT result for reset) */
+                cmd->resp[cmd->resp_cnt++] = data;
+                return true;
+            }
+            return false; // not for us
+        case PS2_CMD_AWAIT_RESP:
+            cmd->resp[cmd->resp_cnt++] = data;
+            cmd->tick_sent = timer_tick;
+            if(cmd->resp_cnt >= cmd->resp_max) ps2_cmd_complete(cmd, PS2_CMD_DONE);
+            return true;
+        default:
+            return false;
+    }
+}
+
+void ps2_cmd_poll(uint8_t port) {
+    struct ps2_cmd_queue* q = &ps2_cmd_queues[port];
+    uintptr_t flags = ps2_irq_save();
+    if(q->head != q->tail) {
+        ps2_cmd_t* cmd = q->cmds[q->head % PS2_CMD_QUEUE_LEN];
+        if(timer_tick - cmd->tick_sent >= cmd->timeout) {
+            if(cmd->state == PS2_CMD_AWAIT_RESP) {
+                if(cmd->resp_cnt >= cmd->resp_min) ps2_cmd_complete(cmd, PS2_CMD_DONE); // variable length response has ended
+                else {
+                    q->timeouts++;
+                    ps2_cmd_complete(cmd, PS2_CMD_FAILED);
+                }
+            } else if(cmd->state == PS2_CMD_AWAIT_ACK) {
+                q->timeouts++;
+                if(++cmd->retries > PS2_DATA_RETRIES) ps2_cmd_complete(cmd, PS2_CMD_FAILED);
+                else ps2_cmd_send_current(cmd);
+            }
+        }
+    }
+    ps2_irq_restore(flags);
+}
+
+bool ps2_cmd_busy(uint8_t port) {
+    return (ps2_cmd_queues[port].head != ps2_cmd_queues[port].tail);
+}
+
+void ps2_cmd_stats(uint8_t port, size_t* resends, size_t* timeouts) {
+    if(resends != NULL) *resends = ps2_cmd_queues[port].resends;
+    if(timeouts != NULL) *timeouts = ps2_cmd_queues[port].timeouts;
+}
@@ -0,0 +1,91 @@
+#ifndef PS2_CMD_H
+#define PS2_CMD_H
+
+#include <kmod.h>
+#include <hal/timer.h>
+
+#define PS2_CMD_MAX_LEN             4 // maximum number of bytes sent per command (incl. arguments)
+#define PS2_CMD_MAX_RESP            4 // maximum number of response bytes (excl. ACKs)
+#define PS2_CMD_QUEUE_LEN           8 // maximum number of queued commands per port (must be a power of two)
+#define PS2_DATA_RETRIES            3 // maximum number of retries for sending data
+
+/* command states */
+#define PS2_CMD_IDLE                0 // not submitted yet
+#define PS2_CMD_QUEUED              1
+#define PS2_CMD_AWAIT_ACK           2 // waiting for current byte to be acknowledged
+#define PS2_CMD_AWAIT_RESP          3 // waiting for response bytes
+#define PS2_CMD_DONE                4
+#define PS2_CMD_FAILED              5
+
+typedef struct {
+    uint8_t port;
+    uint8_t data[PS2_CMD_MAX_LEN]; // bytes to be sent - each one is acknowledged separately
+    uint8_t len;
+    uint8_t resp[PS2_CMD_MAX_RESP]; // response bytes
+    uint8_t resp_min; // minimum number of response bytes (the command completes on timeout once this many have been received)
+    uint8_t resp_max; // maximum number of response bytes (the command completes immediately once this many have been received)
+    volatile uint8_t resp_cnt; // number of response bytes received so far
+    volatile uint8_t state;
+    uint8_t idx; // index of byte being sent
+    uint8_t retries; // number of retries so far
+    timer_tick_t timeout; // response timeout (for each byte)
+    timer_tick_t tick_sent; // time the last byte was sent (or the last response byte was received)
+} ps2_cmd_t;
+
+/*
+ * static inline bool ps2_cmd_pending(const ps2_cmd_t* cmd)
+ *  Returns whether the command has been submitted but not completed yet.
+ */
+static inline bool ps2_cmd_pending(const ps2_cmd_t* cmd) {
+    uint8_t state = __atomic_load_n(&cmd->state, __ATOMIC_ACQUIRE);
+    return (state >= PS2_CMD_QUEUED && state < PS2_CMD_DONE);
+}
+
+/*
+ * void ps2_cmd_init(ps2_cmd_t* cmd, uint8_t port, const uint8_t* data, size_t len, size_t resp_min, size_t resp_max, timer_tick_t timeout)
+ *  Initializes a command structure to be submitted.
+ */
+void ps2_cmd_init(ps2_cmd_t* cmd, uint8_t port, const uint8_t* data, size_t len, size_t resp_min, size_t resp_max, timer_tick_t timeout);
+
+/*
+ * bool ps2_cmd_submit(ps2_cmd_t* cmd)
+ *  Queues a command for its port, sending it right away if the port is idle.
+ *  The command structure must stay valid until the command completes.
+ *  Returns false if the port's command queue is full, in which case the
+ *  command's state is left unchanged.
+ */
+bool ps2_cmd_submit(ps2_cmd_t* cmd);
+
+/*
+ * bool ps2_cmd_wait(ps2_cmd_t* cmd)
+ *  Waits (yielding to other tasks) until the command completes.
+ *  Returns true if the command has completed successfully.
+ */
+bool ps2_cmd_wait(ps2_cmd_t* cmd);
+
+/*
+ * bool ps2_cmd_handle_byte(uint8_t port, uint8_t data)
+ *  Advances the port's command state machine with a byte received from the device.
+ *  Called from the IRQ handler; returns true if the byte has been consumed.
+ */
+bool ps2_cmd_handle_byte(uint8_t port, uint8_t data);
+
+/*
+ * void ps2_cmd_poll(uint8_t port)
+ *  Checks the port's in-flight command for timeouts, retrying or failing it.
+ */
+void ps2_cmd_poll(uint8_t port);
+
+/*
+ * bool ps2_cmd_busy(uint8_t port)
+ *  Returns whether the port has any commands queued or in flight.
+ */
+bool ps2_cmd_busy(uint8_t port);
+
+/*
+ * void ps2_cmd_stats(uint8_t port, size_t* resends, size_t* timeouts)
+ *  Retrieves the port's resend and timeout counters.
+ */
+void ps2_cmd_stats(uint8_t port, size_t* resends, size_t* timeouts);
+
+#endif
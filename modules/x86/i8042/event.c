@@ -0,0 +1,238 @@
+#include "event.h"
+#include <stdio.h>
+#include <string.h>
+#include <fs/devfs.h>
+#include <exec/task.h>
+#include <helpers/mutex.h>
+
+#include "ps2_io.h"
+#include "stats.h"
+
+_Static_assert(PS2_EVENT_BUFLEN >= 2 && (PS2_EVENT_BUFLEN & (PS2_EVENT_BUFLEN - 1)) == 0, "PS2_EVENT_BUFLEN must be a power of two");
+#define PS2_EVENT_BUFMASK           (PS2_EVENT_BUFLEN - 1)
+
+/*
+ * per-task state - devfs callbacks only get the node, so each task that has it open gets its own entry,
+ * with its own position in the port's event ring so that every reader sees the full event stream
+ */
+struct ps2_event_client {
+    void* task; // NULL = free entry
+    size_t opens; // number of times the task has the node open
+    ps2_event_ctl_t ctl;
+    uint32_t rdidx; // free-running index of the next event to be read
+    size_t drops; // events lost since the last read (reported as PS2_SYN_DROPPED)
+    mutex_t signal; // released by ps2_event_push whenever there's new data, and by the timeout task once deadline passes
+    timer_tick_t deadline; // time at which a blocked read times out (0 if it has no timeout)
+};
+
+struct ps2_event_status {
+    vfs_node_t* devfs_node;
+
+    /* event ring buffer and readers (protected by disabling interrupts) */
+    struct ps2_event_client clients[PS2_EVENT_MAX_CLIENTS];
+    ps2_event_t events[PS2_EVENT_BUFLEN];
+    uint32_t wridx; // free-running index
+    size_t drops; // number of events lost by all readers due to falling a whole ring buffer behind
+};
+static struct ps2_event_status ps2_events[2];
+
+void ps2_event_push(uint8_t port, timer_tick_t ts, uint16_t type, uint16_t code, int32_t value) {
+    struct ps2_event_status* ev = &ps2_events[port];
+    if(ev->devfs_node == NULL) return; // nobody can read these
+
+    uintptr_t flags = ps2_irq_save();
+    for(size_t i = 0; i < PS2_EVENT_MAX_CLIENTS; i++) {
+        struct ps2_event_client* client = &ev->clients[i];
+        if(client->task == NULL || ev->wridx - client->rdidx < PS2_EVENT_BUFLEN) continue;
+        client->rdidx++; client->drops++; ev->drops++; // the reader is a whole ring behind - it loses its oldest event
+    }
+    ps2_event_t* event = &ev->events[ev->wridx++ & PS2_EVENT_BUFMASK];
+    event->timestamp = ts; event->type = type; event->code = code; event->value = value;
+    for(size_t i = 0; i < PS2_EVENT_MAX_CLIENTS; i++) {
+        if(ev->clients[i].task != NULL && mutex_test(&ev->clients[i].signal)) mutex_release(&ev->clients[i].signal); // wake up readers
+    }
+    ps2_irq_restore(flags);
+}
+
+size_t ps2_event_stats(uint8_t port) {
+    return ps2_events[port].drops;
+}
+
+/* READ TIMEOUTS */
+
+static mutex_t ps2_event_timer_signal; // released by readers that start waiting with a timeout
+static void* ps2_event_timer_task = NULL; // NULL if timed reads are to poll for their deadline by themselves
+
+/* wakes up readers whose deadline has passed, and returns whether there are any others still waiting */
+static bool ps2_event_timer_check() {
+    bool waiting = false;
+    for(uint8_t port = 0; port < 2; port++) {
+        uintptr_t flags = ps2_irq_save();
+        for(size_t i = 0; i < PS2_EVENT_MAX_CLIENTS; i++) {
+            struct ps2_event_client* client = &ps2_events[port].clients[i];
+            if(client->task == NULL || !client->deadline) continue;
+            if(timer_tick >= client->deadline) {
+                if(mutex_test(&client->signal)) mutex_release(&client->signal);
+            } else waiting = true;
+        }
+        ps2_irq_restore(flags);
+    }
+    return waiting;
+}
+
+/* the only task that polls the timer - timed reads block like untimed ones, and only one task keeps an eye on the clock for them while there are any */
+static void ps2_event_timer_worker() {
+    while(1) {
+        if(ps2_event_timer_check()) task_yield_noirq();
+        else mutex_acquire(&ps2_event_timer_signal); // nobody is waiting with a timeout - wait for a reader to signal us
+    }
+}
+
+/* blocks until the client is signalled or its deadline passes, and returns false in the latter case */
+static bool ps2_event_wait(struct ps2_event_client* client, timer_tick_t deadline) {
+    if(!deadline) {
+        mutex_acquire(&client->signal); // wait for ps2_event_push to signal us
+        return true;
+    }
+    if(timer_tick >= deadline) return false;
+    if(ps2_event_timer_task == NULL) {
+        task_yield_noirq(); // no timeout task to wake us up
+        return true;
+    }
+    __atomic_store_n(&client->deadline, deadline, __ATOMIC_RELEASE);
+    if(mutex_test(&ps2_event_timer_signal)) mutex_release(&ps2_event_timer_signal); // get the timeout task to watch our deadline
+    mutex_acquire(&client->signal);
+    __atomic_store_n(&client->deadline, 0, __ATOMIC_RELEASE);
+    return (timer_tick < deadline);
+}
+
+/* EVENT DEVFS NODE */
+
+/* returns the calling task's entry for the specified port (interrupts must be disabled) */
+static struct ps2_event_client* ps2_event_client(uint8_t port) {
+    void* task = (void*) task_current;
+    for(size_t i = 0; i < PS2_EVENT_MAX_CLIENTS; i++) {
+        if(ps2_events[port].clients[i].task == task) return &ps2_events[port].clients[i];
+    }
+    return NULL;
+}
+
+/* takes up to the specified number of events for the client out of the ring buffer, starting with a drop report if it has lost any */
+static size_t ps2_event_pop(uint8_t port, struct ps2_event_client* client, ps2_event_t* buf, size_t max) {
+    struct ps2_event_status* ev = &ps2_events[port];
+    uintptr_t flags = ps2_irq_save();
+    size_t n = 0;
+    if(client->drops) {
+        buf[n].timestamp = timer_tick; buf[n].type = PS2_EV_SYN; buf[n].code = PS2_SYN_DROPPED; buf[n].value = client->drops;
+        client->drops = 0; n++;
+    }
+    size_t avail = ev->wridx - client->rdidx;
+    if(avail > max - n) avail = max - n;
+    for(size_t i = 0; i < avail; i++, n++) memcpy(&buf[n], &ev->events[client->rdidx++ & PS2_EVENT_BUFMASK], sizeof(ps2_event_t));
+    ps2_irq_restore(flags);
+    return n;
+}
+
+static uint64_t ps2_event_devfs_read(vfs_node_t* node, uint64_t offset, uint64_t size, uint8_t* buf) {
+    (void) offset;
+    uint8_t port = (uintptr_t) node->link.ptr;
+    size_t max = size / sizeof(ps2_event_t);
+    if(max == 0) return 0; // records cannot be split
+
+    uintptr_t flags = ps2_irq_save();
+    struct ps2_event_client* client = ps2_event_client(port); // stays ours until we close the node
+    ps2_event_ctl_t ctl; if(client != NULL) memcpy(&ctl, &client->ctl, sizeof(ps2_event_ctl_t));
+    ps2_irq_restore(flags);
+    if(client == NULL) return 0; // node has not been opened by this task
+
+    timer_tick_t deadline = (ctl.timeout) ? (timer_tick + ctl.timeout) : 0;
+    size_t n; bool timed_out = false;
+    while((n = ps2_event_pop(port, client, (ps2_event_t*) buf, max)) == 0 && !timed_out) {
+        if(ctl.mode & PS2_EVENT_MODE_NONBLOCK) return 0;
+        timed_out = !ps2_event_wait(client, deadline);
+    }
+    if(n == 0) return 0; // timed out
+
+    ps2_event_t* events = (ps2_event_t*) buf;
+    for(size_t i = 0; i < n; i++) {
+        if(events[i].type != PS2_EV_SYN) ps2_lat_record(port, PS2_LAT_READ, events[i].timestamp);
+    }
+    return n * sizeof(ps2_event_t);
+}
+
+static uint64_t ps2_event_devfs_write(vfs_node_t* node, uint64_t offset, uint64_t size, const uint8_t* buf) {
+    (void) offset;
+    uint8_t port = (uintptr_t) node->link.ptr;
+    if(size < sizeof(uint32_t)) return 0;
+    ps2_event_ctl_t ctl = {0, 0};
+    size = (size >= sizeof(ps2_event_ctl_t)) ? sizeof(ps2_event_ctl_t) : sizeof(uint32_t); // mode only, or the whole record
+    memcpy(&ctl, buf, size);
+
+    uintptr_t flags = ps2_irq_save();
+    struct ps2_event_client* client = ps2_event_client(port);
+    if(client != NULL) memcpy(&client->ctl, &ctl, sizeof(ps2_event_ctl_t));
+    ps2_irq_restore(flags);
+    if(client == NULL) return 0; // node has not been opened by this task
+    return size;
+}
+
+static bool ps2_event_devfs_open(vfs_node_t* node, bool read, bool write) {
+    (void) read; (void) write;
+    uint8_t port = (uintptr_t) node->link.ptr;
+    uintptr_t flags = ps2_irq_save();
+    struct ps2_event_client* client = ps2_event_client(port);
+    if(client == NULL) {
+        for(size_t i = 0; i < PS2_EVENT_MAX_CLIENTS; i++) {
+            if(ps2_events[port].clients[i].task == NULL) {
+                client = &ps2_events[port].clients[i];
+                memset(client, 0, sizeof(struct ps2_event_client)); // blocking with no timeout
+                client->task = (void*) task_current;
+                client->rdidx = ps2_events[port].wridx; // start with the events that come in from now on
+                break;
+            }
+        }
+    }
+    if(client != NULL) client->opens++;
+    ps2_irq_restore(flags);
+    if(client == NULL) kwarn("too many tasks have %s open", node->name);
+    return (client != NULL);
+}
+
+static void ps2_event_devfs_close(vfs_node_t* node) {
+    uint8_t port = (uintptr_t) node->link.ptr;
+    uintptr_t flags = ps2_irq_save();
+    struct ps2_event_client* client = ps2_event_client(port);
+    if(client != NULL && --client->opens == 0) client->task = NULL;
+    ps2_irq_restore(flags);
+}
+
+bool ps2_event_attach(uint8_t port) {
+    if(ps2_events[port].devfs_node != NULL) return true; // already created
+
+    if(ps2_event_timer_task == NULL) {
+        ps2_event_timer_task = task_create(false, task_kernel, (uintptr_t) &ps2_event_timer_worker);
+        if(ps2_event_timer_task == NULL) kwarn("cannot create read timeout task - timed reads will poll for their deadline");
+    }
+
+    vfs_node_t* devfs_root = vfs_traverse_path(NULL, "/dev");
+    if(devfs_root == NULL) {
+        kerror("cannot find devfs root");
+        return false;
+    }
+
+    char name[16];
+    for(size_t i = 0; i < 256; i++) {
+        ksprintf(name, "event%u", i); // /dev/eventN
+        if(vfs_finddir(devfs_root, name) == NULL) {
+            vfs_node_t* node = devfs_create(devfs_root, &ps2_event_devfs_read, &ps2_event_devfs_write, &ps2_event_devfs_open, &ps2_event_devfs_close, NULL, false, 0, name);
+            if(node == NULL) break;
+            node->link.ptr = (void*) (uintptr_t) port;
+            __atomic_store_n(&ps2_events[port].devfs_node, node, __ATOMIC_RELEASE); // start accepting events
+            kdebug("event node for port %u is %s", port, name);
+            return true;
+        }
+    }
+
+    kerror("cannot create event node for port %u", port);
+    return false;
+}
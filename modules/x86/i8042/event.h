@@ -0,0 +1,69 @@
+#ifndef PS2_EVENT_H
+#define PS2_EVENT_H
+
+#include <kmod.h>
+#include <hal/timer.h>
+
+#ifndef PS2_EVENT_BUFLEN
+#define PS2_EVENT_BUFLEN            256 // per-port event ring buffer length (must be a power of two) - a reader can fall this many events behind
+#endif
+
+/* event types */
+#define PS2_EV_SYN                  0 // synchronization (code: PS2_SYN_*)
+#define PS2_EV_KEY                  1 // key press/release (code: keycode from hal/kbdcodes.h, value: 1 if pressed)
+#define PS2_EV_REL                  2 // relative motion (code: PS2_REL_*, value: delta)
+#define PS2_EV_BTN                  3 // mouse button press/release (code: button number, value: 1 if pressed)
+
+/* synchronization event codes */
+#define PS2_SYN_REPORT              0 // end of a group of events that belong together (e.g. a mouse packet)
+#define PS2_SYN_DROPPED             1 // the reader has fallen behind and lost the specified number of events (value) before the ones that follow
+
+/* relative motion axes */
+#define PS2_REL_X                   0
+#define PS2_REL_Y                   1 // positive is up, as reported by the device
+#define PS2_REL_WHEEL               2
+
+#define PS2_EVENT_MAX_CLIENTS       16 // maximum number of tasks that can have a port's event node open at once
+
+/* modes (see ps2_event_ctl_t) */
+#define PS2_EVENT_MODE_NONBLOCK     (1 << 0) // reads return immediately if there are no events
+
+/*
+ * settings record written to the event node - these apply to the calling task's
+ * opening of the node only. Writing just the mode (as a uint32_t) is also accepted.
+ * A read with a timeout doubles as a poll: it returns 0 if no events arrive in time.
+ */
+typedef struct {
+    uint32_t mode; // see PS2_EVENT_MODE_*
+    uint32_t timeout; // maximum time (in microseconds) a blocking read waits for events (0 = forever)
+} __attribute__((packed)) ps2_event_ctl_t;
+
+/* event record returned by reading the event node - reads return as many whole records as fit */
+typedef struct {
+    uint64_t timestamp; // IRQ timestamp (in microseconds)
+    uint16_t type; // see PS2_EV_*
+    uint16_t code;
+    int32_t value;
+} __attribute__((packed)) ps2_event_t;
+
+/*
+ * bool ps2_event_attach(uint8_t port)
+ *  Creates the event node for the specified port (if it has not been created yet).
+ */
+bool ps2_event_attach(uint8_t port);
+
+/*
+ * void ps2_event_push(uint8_t port, timer_tick_t ts, uint16_t type, uint16_t code, int32_t value)
+ *  Queues an event on the specified port's event node and wakes up any waiting reader.
+ *  May be called from the IRQ handler.
+ */
+void ps2_event_push(uint8_t port, timer_tick_t ts, uint16_t type, uint16_t code, int32_t value);
+
+/*
+ * size_t ps2_event_stats(uint8_t port)
+ *  Returns the total number of events lost by readers of the specified port
+ *  due to falling a whole event ring buffer behind.
+ */
+size_t ps2_event_stats(uint8_t port);
+
+#endif
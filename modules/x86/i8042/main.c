@@ -9,8 +9,14 @@
 #include <arch/x86cpu/apic.h>
 #include <hal/timer.h>
 #include <kernel/cmdline.h>
+#include <exec/task.h>
+#include <helpers/mutex.h>
 
 #include "ps2_io.h"
+#include "cmd.h"
+#include "mouse.h"
+#include "stats.h"
+#include "event.h"
 
 #include "kbd/scset1.h"
 #include "kbd/scset2.h"
@@ -22,15 +28,40 @@ static uint8_t ps2_p2_irq = PS2_P2_IRQNUM; // IRQ or GSI for second port
 
 #define PS2_DATA_TIMEOUT        100000UL // response timeout in microseconds
 #define PS2_RESET_TIMEOUT       1000000UL // device reset response timeout in microseconds
-#define PS2_DATA_BUFLEN         8 // data ring buffer length
-#define PS2_DATA_RETRIES        3 // maximum number of retries for sending data
+#ifndef PS2_DATA_BUFLEN
+#define PS2_DATA_BUFLEN         64 // data ring buffer length (must be a power of two)
+#endif
+_Static_assert(PS2_DATA_BUFLEN >= 2 && (PS2_DATA_BUFLEN & (PS2_DATA_BUFLEN - 1)) == 0, "PS2_DATA_BUFLEN must be a power of two");
+#define PS2_DATA_BUFMASK        (PS2_DATA_BUFLEN - 1)
+
+/* device bring-up states */
+#define PS2_INIT_NONE           0 // not started (no device or port not working)
+#define PS2_INIT_RESET          1 // waiting for reset (BAT) result
+#define PS2_INIT_IDENTIFY       2 // waiting for device ID
+#define PS2_INIT_SETUP          3 // waiting for device specific setup to complete
+#define PS2_INIT_MOUSE_PROBE    4 // waiting for the result of an IntelliMouse extension probe
+#define PS2_INIT_ONLINE         5
+#define PS2_INIT_FAILED         6
+#define PS2_INIT_MAX_CMDS       4 // maximum number of commands submitted in one bring-up step
 
 struct ps2_port_status {
     bool ok;
     uint16_t id;
     bool parse; // set to parse data according to ID
+    /* incoming data ring buffer (single producer: IRQ handler, single consumer) */
     volatile uint8_t data[PS2_DATA_BUFLEN];
-    volatile uint8_t data_rdidx, data_wridx;
+    volatile timer_tick_t data_ts[PS2_DATA_BUFLEN]; // time each byte was received
+    uint32_t data_rdidx, data_wridx; // free-running indices (masked with PS2_DATA_BUFMASK on access)
+    bool data_overflowing; // set while the ring buffer is full
+    volatile size_t data_overflows; // number of times the ring buffer became full
+    volatile size_t data_drops; // number of bytes dropped due to the ring buffer being full
+
+    /* device bring-up (see ps2_init_step) */
+    volatile uint8_t init_state;
+    ps2_cmd_t init_cmds[PS2_INIT_MAX_CMDS]; // reset/identification/setup commands in flight
+    uint8_t init_ncmds; // number of commands submitted in the current step
+
+    bool mouse; // set if the device is a mouse (handled in mouse.c)
 
     /* keyboard handling */
     struct {
@@ -40,20 +71,55 @@ struct ps2_port_status {
         bool brk; // set if break code is being sent
         uint8_t ext; // extension byte (E0/E1) or 0 if there's none
         uint8_t code; // scancode (excl. extension byte)
+        uint8_t leds; // lock state shown on the LEDs (PS2_KBD_LED_*)
+        bool leds_dirty; // set if the LEDs have yet to be updated
     } kbd;
 };
 static struct ps2_port_status ps2_ports[2];
 
+/* PS/2 KEYBOARD LEDS */
+
+static ps2_cmd_t ps2_kbd_led_cmd[2]; // left to complete asynchronously
+
+/* sends the keyboard's lock state to its LEDs, or leaves it for later if the previous update is still in flight */
+static void ps2_kbd_update_leds(uint8_t port) {
+    struct ps2_port_status* st = &ps2_ports[port];
+    st->kbd.leds_dirty = true;
+    if(ps2_cmd_pending(&ps2_kbd_led_cmd[port])) return; // retried by ps2_bh_decode
+    ps2_cmd_init(&ps2_kbd_led_cmd[port], port, (uint8_t[]) {PS2_DEVCMD_KBD_SET_LED, st->kbd.leds}, 2, 0, 0, PS2_DATA_TIMEOUT);
+    if(ps2_cmd_submit(&ps2_kbd_led_cmd[port])) st->kbd.leds_dirty = false;
+}
+
 /* PS/2 KEYBOARD INCOMING DATA HANDLER */
 
-static void ps2_kbd_handler(uint8_t port, uint8_t data) {
+static void ps2_kbd_deliver(uint8_t port, uint8_t keycode, timer_tick_t ts) {
+    bool pressed = !ps2_ports[port].kbd.brk;
+    kbd_keypress(ps2_ports[port].kbd.id, pressed, keycode);
+    ps2_event_push(port, ts, PS2_EV_KEY, keycode, pressed);
+    ps2_lat_record(port, PS2_LAT_DELIVER, ts);
+
+    if(pressed) {
+        uint8_t led = 0;
+        switch(keycode) {
+            case KEY_SCROLLLOCK: led = PS2_KBD_LED_SCROLL; break;
+            case KEY_NUMLOCK: led = PS2_KBD_LED_NUM; break;
+            case KEY_CAPSLOCK: led = PS2_KBD_LED_CAPS; break;
+        }
+        if(led) {
+            ps2_ports[port].kbd.leds ^= led;
+            ps2_kbd_update_leds(port);
+        }
+    }
+}
+
+static void ps2_kbd_handler(uint8_t port, uint8_t data, timer_tick_t ts) {
     switch(ps2_ports[port].kbd.scset) {
         case 1: // scancode set 1
             if(data == 0xE0 || data == 0xE1) ps2_ports[port].kbd.ext = data;
             else {
                 ps2_ports[port].kbd.brk = (data & 0x80);
                 ps2_ports[port].kbd.code = data & 0x7F;
-                kbd_keypress(ps2_ports[port].kbd.id, !ps2_ports[port].kbd.brk, (ps2_ports[port].kbd.ext) ? ps2_kbd_scset1_ext[ps2_ports[port].kbd.code] : ps2_kbd_scset1_reg[ps2_ports[port].kbd.code]);
+                ps2_kbd_deliver(port, (ps2_ports[port].kbd.ext) ? ps2_kbd_scset1_ext[ps2_ports[port].kbd.code] : ps2_kbd_scset1_reg[ps2_ports[port].kbd.code], ts);
                 ps2_ports[port].kbd.ext = 0;
             }
             break;
@@ -62,7 +128,7 @@ static void ps2_kbd_handler(uint8_t port, uint8_t data) {
             else if(data == 0xF0) ps2_ports[port].kbd.brk = true;
             else {
                 ps2_ports[port].kbd.code = data;
-                kbd_keypress(ps2_ports[port].kbd.id, !ps2_ports[port].kbd.brk, (ps2_ports[port].kbd.ext) ? ps2_kbd_scset2_ext[ps2_ports[port].kbd.code] : ps2_kbd_scset2_reg[ps2_ports[port].kbd.code]);
+                ps2_kbd_deliver(port, (ps2_ports[port].kbd.ext) ? ps2_kbd_scset2_ext[ps2_ports[port].kbd.code] : ps2_kbd_scset2_reg[ps2_ports[port].kbd.code], ts);
                 ps2_ports[port].kbd.ext = 0;
                 ps2_ports[port].kbd.brk = false;
             }
@@ -73,178 +139,294 @@ static void ps2_kbd_handler(uint8_t port, uint8_t data) {
     }
 } 
 
-/* PS/2 DEVICE INCOMING DATA IRQ HANDLER */
-
-static void ps2_irq_handler(size_t irq, void* context) {
-    (void) context;
-    uint8_t port = (irq == ps2_p2_irq) ? 1 : 0;
-    uint8_t data = inb(PS2_IO_DATA); // read data from controller
-    // kdebug("PS/2 keyboard driver handling IRQ %u (port %u), data: 0x%02x", irq, port, data);
+/* PS/2 DEVICE INCOMING DATA BUFFER ACCESS */
 
-    if(ps2_ports[port].parse) {
-        if(ps2_ports[port].kbd.enabled) ps2_kbd_handler(port, data);
-    } else {
-        if((ps2_ports[port].data_wridx + 1) % PS2_DATA_BUFLEN == ps2_ports[port].data_rdidx) kwarn("PS/2 port %u (ID 0x%x) buffer is full (data 0x%02x)", port, ps2_ports[port].id, data);
-        else {
-            ps2_ports[port].data[ps2_ports[port].data_wridx] = data;
-            ps2_ports[port].data_wridx = (ps2_ports[port].data_wridx + 1) % PS2_DATA_BUFLEN;
+/* called from the IRQ handler only (producer side) */
+static void ps2_data_push(uint8_t port, uint8_t data, timer_tick_t ts) {
+    struct ps2_port_status* st = &ps2_ports[port];
+    uint32_t wridx = st->data_wridx; // only written by us
+    if(wridx - __atomic_load_n(&st->data_rdidx, __ATOMIC_ACQUIRE) >= PS2_DATA_BUFLEN) {
+        st->data_drops++;
+        if(!st->data_overflowing) {
+            /* only report once per overflow */
+            st->data_overflowing = true;
+            st->data_overflows++;
+            kwarn("PS/2 port %u (ID 0x%x) buffer is full (data 0x%02x)", port, st->id, data);
         }
+        return;
     }
+    st->data_overflowing = false;
+    st->data[wridx & PS2_DATA_BUFMASK] = data;
+    st->data_ts[wridx & PS2_DATA_BUFMASK] = ts;
+    __atomic_store_n(&st->data_wridx, wridx + 1, __ATOMIC_RELEASE); // publish data before index
 }
 
-/* PS/2 DEVICE INCOMING DATA BUFFER ACCESS */
-
 static void ps2_data_reset_buf(uint8_t port) {
-    ps2_ports[port].data_rdidx = 0;
-    ps2_ports[port].data_wridx = 0;
+    /* discard everything currently in the buffer (consumer side, so this is safe against the IRQ handler) */
+    __atomic_store_n(&ps2_ports[port].data_rdidx, __atomic_load_n(&ps2_ports[port].data_wridx, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
 }
 
 static size_t ps2_data_available(uint8_t port) {
-    if(ps2_ports[port].data_wridx >= ps2_ports[port].data_rdidx)
-        return (ps2_ports[port].data_wridx - ps2_ports[port].data_rdidx);
-    else
-        return (PS2_DATA_BUFLEN - ps2_ports[port].data_rdidx + ps2_ports[port].data_wridx);
+    return __atomic_load_n(&ps2_ports[port].data_wridx, __ATOMIC_ACQUIRE) - ps2_ports[port].data_rdidx;
 }
 
-static uint8_t ps2_data_read(uint8_t port) {
-    while(ps2_data_available(port) == 0);
-    uint8_t ret = ps2_ports[port].data[ps2_ports[port].data_rdidx];
-    ps2_ports[port].data_rdidx = (ps2_ports[port].data_rdidx + 1) % PS2_DATA_BUFLEN;
-    return ret;
+static bool ps2_data_pop(uint8_t port, uint8_t* data, timer_tick_t* ts) {
+    if(ps2_data_available(port) == 0) return false;
+    uint32_t rdidx = ps2_ports[port].data_rdidx; // only written by us
+    *data = ps2_ports[port].data[rdidx & PS2_DATA_BUFMASK];
+    if(ts != NULL) *ts = ps2_ports[port].data_ts[rdidx & PS2_DATA_BUFMASK];
+    __atomic_store_n(&ps2_ports[port].data_rdidx, rdidx + 1, __ATOMIC_RELEASE); // release slot after reading data
+    return true;
 }
 
-static bool ps2_data_read_timeout(uint8_t port, uint8_t* data, timer_tick_t timeout) {
-    timer_tick_t t_start = timer_tick;
-    while(timer_tick - t_start < timeout) {
-        if(ps2_data_available(port) > 0) {
-            // kdebug("got response after %u", (size_t) (timer_tick - t_start));
-            break;
-        }
+/*
+ * void ps2_data_stats(uint8_t port, size_t* overflows, size_t* drops)
+ *  Retrieves the specified port's ring buffer overflow and dropped byte counters.
+ */
+void ps2_data_stats(uint8_t port, size_t* overflows, size_t* drops) {
+    if(overflows != NULL) *overflows = ps2_ports[port].data_overflows;
+    if(drops != NULL) *drops = ps2_ports[port].data_drops;
+}
+
+/* PS/2 DEFERRED DATA PROCESSING (BOTTOM HALF) */
+
+static mutex_t ps2_bh_signal; // released by the IRQ handler whenever there's data to be processed
+static void* ps2_bh_task = NULL; // NULL if data is to be processed in the IRQ handler instead
+
+static bool ps2_init_step(uint8_t port);
+
+static bool ps2_init_pending() {
+    for(uint8_t port = 0; port < 2; port++) {
+        uint8_t state = __atomic_load_n(&ps2_ports[port].init_state, __ATOMIC_ACQUIRE);
+        if(state != PS2_INIT_NONE && state < PS2_INIT_ONLINE) return true;
     }
-    if(ps2_data_available(port) > 0) {
-        *data = ps2_data_read(port);
-        return true;
-    } else return false;
+    return false;
 }
 
-/* PS/2 DEVICE DATA TRANSMISSION */
-
-static bool ps2_send_data_ack(uint8_t port, uint8_t data) {
-    for(size_t i = 0; i < PS2_DATA_RETRIES; i++) {
-        ps2_send_data(port, data);
-        uint8_t resp;
-        if(!ps2_data_read_timeout(port, &resp, PS2_DATA_TIMEOUT)) return false; // timed out waiting for response
-        switch(resp) {
-            case PS2_DEVRESP_ACK: return true; // command acknowledged
-            case PS2_DEVRESP_RESEND: continue; // retry
-            default:
-                kdebug("unexpected response 0x%02x", resp);
-                continue; // TODO
-        }
+static void ps2_bh_decode(uint8_t port) {
+    uint8_t data; timer_tick_t ts;
+    while(ps2_data_pop(port, &data, &ts)) { // decode everything that has come in so far in one go
+        if(ps2_ports[port].kbd.enabled) ps2_kbd_handler(port, data, ts);
+    }
+    if(ps2_ports[port].kbd.leds_dirty) ps2_kbd_update_leds(port); // lock keys were pressed while the LEDs were being updated
+}
+
+static void ps2_bh_process() {
+    for(uint8_t port = 0; port < 2; port++) {
+        ps2_cmd_poll(port); // check for command timeouts
+        while(ps2_init_step(port)); // advance device bring-up as far as possible
+        if(!ps2_ports[port].parse) continue; // device is not online yet
+        ps2_bh_decode(port);
+    }
+}
+
+static void ps2_bh_worker() {
+    while(1) {
+        if(ps2_init_pending()) task_yield_noirq(); // devices are being brought up - keep polling for command timeouts
+        else mutex_acquire(&ps2_bh_signal); // wait for the IRQ handler to signal us
+        ps2_bh_process();
+    }
+}
+
+/* PS/2 DEVICE INCOMING DATA IRQ HANDLER */
+
+static void ps2_irq_handler(size_t irq, void* context) {
+    (void) context;
+    timer_tick_t ts = timer_tick;
+    uint8_t port = (irq == ps2_p2_irq) ? 1 : 0;
+    uint8_t data = inb(PS2_IO_DATA); // read data from controller
+    // kdebug("PS/2 keyboard driver handling IRQ %u (port %u), data: 0x%02x", irq, port, data);
+
+    if(ps2_cmd_handle_byte(port, data)) return; // response to a command we've sent
+
+    if(ps2_ports[port].parse && ps2_ports[port].mouse) {
+        ps2_mouse_handle_byte(port, data, ts); // mouse packets are small enough to be assembled right here
+        return;
+    }
+
+    ps2_data_push(port, data, ts);
+    if(ps2_ports[port].parse) {
+        /* leave decoding to the bottom half */
+        if(ps2_bh_task == NULL) ps2_bh_decode(port);
+        else if(mutex_test(&ps2_bh_signal)) mutex_release(&ps2_bh_signal);
     }
-    return false; // comm failure
 }
 
 /* PS/2 DEVICE RESET AND IDENTIFICATION */
 
-static bool ps2_post_identify(uint8_t port) {
-    if(ps2_ports[port].id == 0xFFFF || ps2_ports[port].id == 0xAB83 || ps2_ports[port].id == 0xAB84 || ps2_ports[port].id == 0xAB85 || ps2_ports[port].id == 0xAB86 || ps2_ports[port].id == 0xAB90 || ps2_ports[port].id == 0xAB91 || ps2_ports[port].id == 0xAB92 || ps2_ports[port].id == 0xACA1) {
+/* submits a command for the current bring-up step */
+static bool ps2_init_submit(uint8_t port, const uint8_t* data, size_t len, size_t resp_min, size_t resp_max, timer_tick_t timeout) {
+    struct ps2_port_status* st = &ps2_ports[port];
+    if(st->init_ncmds >= PS2_INIT_MAX_CMDS) return false;
+    ps2_cmd_t* cmd = &st->init_cmds[st->init_ncmds++];
+    ps2_cmd_init(cmd, port, data, len, resp_min, resp_max, timeout);
+    return ps2_cmd_submit(cmd);
+}
+
+/* sends the magic sample rate sequence that unlocks a mouse extension, followed by a request for the (new) ID */
+static bool ps2_mouse_probe(uint8_t port, uint8_t rate_2) {
+    ps2_ports[port].init_ncmds = 0;
+    return ps2_init_submit(port, (uint8_t[]) {PS2_DEVCMD_MOUSE_SET_RATE, 200}, 2, 0, 0, PS2_DATA_TIMEOUT)
+        && ps2_init_submit(port, (uint8_t[]) {PS2_DEVCMD_MOUSE_SET_RATE, rate_2}, 2, 0, 0, PS2_DATA_TIMEOUT)
+        && ps2_init_submit(port, (uint8_t[]) {PS2_DEVCMD_MOUSE_SET_RATE, 80}, 2, 0, 0, PS2_DATA_TIMEOUT)
+        && ps2_init_submit(port, (uint8_t[]) {PS2_DEVCMD_IDENTIFY}, 1, 1, 1, PS2_DATA_TIMEOUT);
+}
+
+/* sets the mouse's actual sample rate and enables data reporting */
+static bool ps2_mouse_setup(uint8_t port) {
+    uint8_t rate = ps2_mouse_rate(port);
+    kdebug("mouse on port %u (ID 0x%02x): setting sample rate to %u", port, ps2_ports[port].id, rate);
+    ps2_ports[port].init_ncmds = 0;
+    return ps2_init_submit(port, (uint8_t[]) {PS2_DEVCMD_MOUSE_SET_RATE, rate}, 2, 0, 0, PS2_DATA_TIMEOUT)
+        && ps2_init_submit(port, (uint8_t[]) {PS2_DEVCMD_ENABLE_DATA}, 1, 0, 0, PS2_DATA_TIMEOUT);
+}
+
+/* performs device specific setup after identification, returning the next bring-up state */
+static uint8_t ps2_post_identify(uint8_t port) {
+    struct ps2_port_status* st = &ps2_ports[port];
+    if(st->id == 0xFFFF || st->id == 0xAB83 || st->id == 0xAB84 || st->id == 0xAB85 || st->id == 0xAB86 || st->id == 0xAB90 || st->id == 0xAB91 || st->id == 0xAB92 || st->id == 0xACA1) {
         /* keyboard */
-        if(ps2_ports[port].kbd.enabled) kbd_unregister(ps2_ports[port].kbd.id);
-        ps2_ports[port].kbd.enabled = true;
-        ps2_ports[port].kbd.id = kbd_register(NULL); // default keymap
-        ps2_ports[port].kbd.brk = false;
+        if(st->kbd.enabled) kbd_unregister(st->kbd.id);
+        st->kbd.enabled = true;
+        st->kbd.id = kbd_register(NULL); // default keymap
+        st->kbd.brk = false;
 
         /* check for scancode set override in kernel cmdline */
         char override_key[] = "i8042_p#scs"; override_key[7] = port + '0';
         const char* override_scs = cmdline_find_kvp(override_key);
         if(override_scs != NULL) {
-            ps2_ports[port].kbd.scset = strtoul(override_scs, NULL, 10);
-            kdebug("port %u keyboard scancode set overridden to %u by kernel cmdline", port, ps2_ports[port].kbd.scset);
-        } else {
-            if(!ps2_send_data_ack(port, PS2_DEVCMD_KBD_SCSET)) {
-                kerror("communication failure on port %u sending PS2_DEVCMD_KBD_SCSET cmd", port);
-                return false;
-            }
-            if(!ps2_send_data_ack(port, 0)) { // get scancode set
-                kerror("communication failure on port %u sending PS2_DEVCMD_KBD_SCSET argument", port);
-                return false;
-            }
-            if(!ps2_data_read_timeout(port, &ps2_ports[port].kbd.scset, PS2_DATA_TIMEOUT)) {
-                kerror("timed out waiting on port %u for scancode set", port);
-                return false;
-            } else {
-                /* handle "translated" results sent by certain hardware such as VMware */
-                switch(ps2_ports[port].kbd.scset) {
-                    case 0x43: ps2_ports[port].kbd.scset = 1; break;
-                    case 0x41: ps2_ports[port].kbd.scset = 2; break;
-                    case 0x3F: ps2_ports[port].kbd.scset = 3; break;
-                    default: break;
-                }
-                kdebug("keyboard on port %u uses scancode set %u", port, ps2_ports[port].kbd.scset);
-            }
+            st->kbd.scset = strtoul(override_scs, NULL, 10);
+            kdebug("port %u keyboard scancode set overridden to %u by kernel cmdline", port, st->kbd.scset);
+            return PS2_INIT_ONLINE;
         }
+
+        st->init_ncmds = 0;
+        return (ps2_init_submit(port, (uint8_t[]) {PS2_DEVCMD_KBD_SCSET, 0}, 2, 1, 1, PS2_DATA_TIMEOUT)) ? PS2_INIT_SETUP : PS2_INIT_FAILED; // get scancode set
     }
 
-    return true;
+    if(ps2_mouse_is_mouse(st->id)) {
+        /* mouse - try to unlock the wheel (and then the extra buttons) */
+        if(st->id == PS2_MOUSE_ID_5BTN) return (ps2_mouse_setup(port)) ? PS2_INIT_SETUP : PS2_INIT_FAILED;
+        return (ps2_mouse_probe(port, (st->id == PS2_MOUSE_ID_WHEEL) ? 200 : 100)) ? PS2_INIT_MOUSE_PROBE : PS2_INIT_FAILED;
+    }
+
+    kwarn("unsupported device 0x%04x on port %u", st->id, port);
+    return PS2_INIT_ONLINE;
 }
 
-static bool ps2_reset_device(uint8_t port) {
-    bool parse = ps2_ports[port].parse; // save parse status
-    ps2_data_reset_buf(port); // discard any pending data
-    ps2_send_data(port, PS2_DEVCMD_RESET);
-    uint8_t resp_1;
-    if(ps2_data_read_timeout(port, &resp_1, PS2_RESET_TIMEOUT)) {
-        if(resp_1 != 0xFA && resp_1 != 0xAA) {
-            kerror("resetting on port %u: unexpected 1st byte 0x%02x", port, resp_1);
-            return false;
-        } else kdebug("resetting on port %u: received 1st byte 0x%02x", port, resp_1);
-
-        uint8_t resp_2;
-        if(ps2_data_read_timeout(port, &resp_2, PS2_RESET_TIMEOUT)) {
-            if(!((resp_1 == 0xFA && resp_2 == 0xAA) || (resp_1 == 0xAA && resp_2 == 0xFA))) {
-                kerror("resetting on port %u: unexpected 2nd byte 0x%02x (1st byte 0x%02x)", port, resp_2, resp_1);
-                return false;
-            } else kdebug("resetting on port %u: received 2nd byte 0x%02x", port, resp_2);
-
-            /* get ID */
-            ps2_ports[port].id = 0;
-            if(ps2_data_read_timeout(port, (uint8_t*)&ps2_ports[port].id, PS2_DATA_TIMEOUT)) {
-                if(ps2_ports[port].id == 0xAB || ps2_ports[port].id == 0xAC) {
-                    /* additional ID byte awaits */
-                    ps2_ports[port].id <<= 8;
-                    if(ps2_data_read_timeout(port, (uint8_t*)&ps2_ports[port].id, PS2_DATA_TIMEOUT)) {
-                        ps2_ports[port].id = (ps2_ports[port].id << 8) | ps2_data_read(port);
-                    } else kwarn("resetting on port %u: timed out waiting for expected 2nd ID byte", port);
-                }
-            } else {
-                kdebug("resetting on port %u: timed out waiting for ID byte - probably keyboard", port);
-                ps2_ports[port].id = 0xFFFF;
-            }
-        } else {
-            kerror("resetting on port %u: timed out waiting for 2nd byte", port);
+/* handles the result of the setup commands submitted by ps2_post_identify */
+static bool ps2_post_setup(uint8_t port) {
+    struct ps2_port_status* st = &ps2_ports[port];
+    for(uint8_t i = 0; i < st->init_ncmds; i++) {
+        if(st->init_cmds[i].state != PS2_CMD_DONE) {
+            kerror("communication failure on port %u during device setup (command 0x%02x)", port, st->init_cmds[i].data[0]);
             return false;
         }
-    } else {
-        kerror("resetting on port %u: timed out waiting for 1st byte", port);
-        return false;
     }
 
-    /* check for override in cmdline */
-    char override_key[] = "i8042_p#id"; // we'll replace # by the port number here
-    override_key[7] = port + '0';
-    const char* override_id = cmdline_find_kvp(override_key);
-    if(override_id != NULL) {
-        ps2_ports[port].id = strtoul(override_id, NULL, 16);
-        kdebug("port %u device ID overridden to 0x%04x by kernel cmdline", port, ps2_ports[port].id);
+    if(st->kbd.enabled) {
+        st->kbd.scset = st->init_cmds[0].resp[0];
+        /* handle "translated" results sent by certain hardware such as VMware */
+        switch(st->kbd.scset) {
+            case 0x43: st->kbd.scset = 1; break;
+            case 0x41: st->kbd.scset = 2; break;
+            case 0x3F: st->kbd.scset = 3; break;
+            default: break;
+        }
+        kdebug("keyboard on port %u uses scancode set %u", port, st->kbd.scset);
+    } else if(ps2_mouse_is_mouse(st->id)) {
+        if(!ps2_mouse_attach(port, st->id)) return false;
+        st->mouse = true;
     }
+    return true;
+}
+
+/* starts resetting the device on the specified port - the rest of the bring-up happens in ps2_init_step */
+static bool ps2_init_start(uint8_t port) {
+    struct ps2_port_status* st = &ps2_ports[port];
+    st->parse = false; st->mouse = false;
+    ps2_data_reset_buf(port); // discard any pending data
+    st->init_ncmds = 0;
+    if(!ps2_init_submit(port, (uint8_t[]) {PS2_DEVCMD_RESET}, 1, 1, 1, PS2_RESET_TIMEOUT)) return false; // ACK and BAT result may come in either order
+    __atomic_store_n(&st->init_state, PS2_INIT_RESET, __ATOMIC_RELEASE); // only publish once the command is in flight
+    return true;
+}
+
+/*
+ * advances the port's bring-up state machine once its current command has completed
+ * returns true if progress has been made (so the caller can call again)
+ */
+static bool ps2_init_step(uint8_t port) {
+    struct ps2_port_status* st = &ps2_ports[port];
+    uint8_t state = __atomic_load_n(&st->init_state, __ATOMIC_ACQUIRE);
+    if(state == PS2_INIT_NONE || state >= PS2_INIT_ONLINE) return false;
+    ps2_cmd_t* cmd = &st->init_cmds[st->init_ncmds - 1]; // last command of the current step (commands complete in order)
+    if(ps2_cmd_pending(cmd)) return false;
+
+    bool ok = (cmd->state == PS2_CMD_DONE);
+    switch(state) {
+        case PS2_INIT_RESET:
+            if(!ok) {
+                kerror("resetting on port %u: no response from device", port);
+                state = PS2_INIT_FAILED;
+            } else if(cmd->resp[0] != PS2_DEVRESP_BAT_OK) {
+                kerror("resetting on port %u: unexpected self-test result 0x%02x", port, cmd->resp[0]);
+                state = PS2_INIT_FAILED;
+            } else {
+                kdebug("resetting on port %u: self-test passed", port);
+                ps2_data_reset_buf(port); // discard the ID byte that mice send after the BAT result (we'll ask for it anyway)
+                st->init_ncmds = 0;
+                state = (ps2_init_submit(port, (uint8_t[]) {PS2_DEVCMD_IDENTIFY}, 1, 0, 2, PS2_DATA_TIMEOUT)) ? PS2_INIT_IDENTIFY : PS2_INIT_FAILED; // keyboards may not send an ID at all
+            }
+            break;
+        case PS2_INIT_IDENTIFY:
+            if(!ok) {
+                kerror("identifying on port %u: no response from device", port);
+                state = PS2_INIT_FAILED;
+                break;
+            }
+            if(cmd->resp_cnt == 0) {
+                kdebug("identifying on port %u: no ID bytes received - probably keyboard", port);
+                st->id = 0xFFFF;
+            } else if(cmd->resp_cnt == 2 && (cmd->resp[0] == 0xAB || cmd->resp[0] == 0xAC)) st->id = (cmd->resp[0] << 8) | cmd->resp[1];
+            else st->id = cmd->resp[cmd->resp_cnt - 1]; // the first byte may be a late ID byte from the reset
+
+            /* check for override in cmdline */
+            char override_key[] = "i8042_p#id"; // we'll replace # by the port number here
+            override_key[7] = port + '0';
+            const char* override_id = cmdline_find_kvp(override_key);
+            if(override_id != NULL) {
+                st->id = strtoul(override_id, NULL, 16);
+                kdebug("port %u device ID overridden to 0x%04x by kernel cmdline", port, st->id);
+            }
 
-    if(!ps2_post_identify(port)) { // perform post-identification tasks (e.g. device specific setup))
-        kerror("resetting on port %u: post-ID tasks failed");
-        return false;
+            kdebug("port %u device ID: 0x%04x", port, st->id);
+            state = ps2_post_identify(port); // perform post-identification tasks (e.g. device specific setup)
+            break;
+        case PS2_INIT_MOUSE_PROBE:
+            if(ok && cmd->resp[0] > st->id && ps2_mouse_is_mouse(cmd->resp[0])) {
+                kdebug("port %u: mouse extension unlocked (ID 0x%02x -> 0x%02x)", port, st->id, cmd->resp[0]);
+                st->id = cmd->resp[0];
+                if(st->id == PS2_MOUSE_ID_WHEEL) { // try for the extra buttons too
+                    state = (ps2_mouse_probe(port, 200)) ? PS2_INIT_MOUSE_PROBE : PS2_INIT_FAILED;
+                    break;
+                }
+            } else if(!ok) kwarn("port %u: mouse extension probe failed - continuing with ID 0x%02x", port, st->id);
+            state = (ps2_mouse_setup(port)) ? PS2_INIT_SETUP : PS2_INIT_FAILED;
+            break;
+        case PS2_INIT_SETUP:
+            state = (ps2_post_setup(port)) ? PS2_INIT_ONLINE : PS2_INIT_FAILED;
+            break;
+        default: break;
     }
 
-    ps2_ports[port].parse = parse; // restore parse status
+    if(state == PS2_INIT_ONLINE) {
+        ps2_event_attach(port);
+        ps2_data_reset_buf(port); // discard anything that came in while we were setting up
+        st->parse = true;
+        kinfo("device 0x%04x on port %u is online", st->id, port);
+    } else if(state == PS2_INIT_FAILED) kerror("device initialization on port %u failed", port);
+    __atomic_store_n(&st->init_state, state, __ATOMIC_RELEASE);
     return true;
 }
 
@@ -325,6 +507,10 @@ int32_t kmod_init(elf_prgload_t* load_result, size_t load_result_len) {
         }
     } else kwarn("second port seems to still be enabled - malfunction suspected");
 
+    kdebug("starting bottom half task");
+    ps2_bh_task = task_create(false, task_kernel, (uintptr_t) &ps2_bh_worker);
+    if(ps2_bh_task == NULL) kwarn("cannot create bottom half task - incoming data will be processed in the IRQ handler");
+
     kdebug("setting up interrupts");
     ps2_write_ccb(ps2_read_ccb() | ((ps2_ports[0].ok) ? PS2_CCB_P1_IRQ : 0) | ((ps2_ports[1].ok) ? PS2_CCB_P2_IRQ : 0));
     if(apic_enabled) {
@@ -338,18 +524,20 @@ int32_t kmod_init(elf_prgload_t* load_result, size_t load_result_len) {
         pic_unmask_bm(((ps2_ports[0].ok) ? (1 << PS2_P1_IRQNUM) : 0) | ((ps2_ports[1].ok) ? (1 << PS2_P2_IRQNUM) : 0));
     }
 
+    /* reset and identify devices on both ports concurrently - this continues in the background */
     for(uint8_t i = 0; i < 2; i++) {
         if(ps2_ports[i].ok) {
             kdebug("resetting device on port %u and retrieving device ID", i);
-            if(!ps2_reset_device(i)) {
-                kerror("device reset failed");
-                // TODO
-            } else {
-                kdebug("port %u device ID: 0x%04x", i, ps2_ports[i].id);
-                ps2_ports[i].parse = true;
-            }
+            if(!ps2_init_start(i)) kerror("cannot submit reset command on port %u", i);
         }
     }
+    if(ps2_bh_task != NULL) {
+        if(mutex_test(&ps2_bh_signal)) mutex_release(&ps2_bh_signal); // kick the bottom half so it starts polling
+    } else {
+        while(ps2_init_pending()) ps2_bh_process(); // no bottom half to leave this to
+    }
+
+    ps2_stats_init();
 
     kinfo("PS/2 controller initialized successfully");
     return 0;
@@ -0,0 +1,183 @@
+#include "mouse.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <kernel/cmdline.h>
+#include <fs/devfs.h>
+
+#include "ps2_io.h"
+#include "stats.h"
+#include "event.h"
+
+/* packet byte 0 flags */
+#define PS2_MOUSE_PKT_ALWAYS1       (1 << 3) // always set - used to resynchronize
+#define PS2_MOUSE_PKT_XSIGN         (1 << 4)
+#define PS2_MOUSE_PKT_YSIGN         (1 << 5)
+#define PS2_MOUSE_PKT_XOVF          (1 << 6)
+#define PS2_MOUSE_PKT_YOVF          (1 << 7)
+
+struct ps2_mouse_status {
+    bool enabled;
+    uint16_t id;
+    vfs_node_t* devfs_node;
+
+    /* packet assembly (IRQ handler only) */
+    uint8_t packet[4];
+    uint8_t packet_len; // 3 or 4 bytes depending on ID
+    uint8_t packet_idx;
+    timer_tick_t packet_ts; // time the last byte was received
+    size_t desyncs; // number of bytes discarded to resynchronize
+
+    /* accumulated motion (protected by disabling interrupts) */
+    ps2_mouse_report_t accum;
+    timer_tick_t accum_ts; // IRQ timestamp of the oldest packet in accum
+};
+static struct ps2_mouse_status ps2_mice[2];
+
+bool ps2_mouse_is_mouse(uint16_t id) {
+    return (id == PS2_MOUSE_ID_STANDARD || id == PS2_MOUSE_ID_WHEEL || id == PS2_MOUSE_ID_5BTN);
+}
+
+uint8_t ps2_mouse_rate(uint8_t port) {
+    char override_key[] = "i8042_p#rate"; override_key[7] = port + '0';
+    const char* override_rate = cmdline_find_kvp(override_key);
+    if(override_rate != NULL) {
+        unsigned long rate = strtoul(override_rate, NULL, 10);
+        switch(rate) {
+            case 10: case 20: case 40: case 60: case 80: case 100: case 200: // valid sample rates
+                kdebug("port %u mouse sample rate overridden to %u by kernel cmdline", port, rate);
+                return rate;
+            default:
+                kwarn("port %u: invalid mouse sample rate %u in kernel cmdline - using default", port, rate);
+                break;
+        }
+    }
+    return PS2_MOUSE_DEFAULT_RATE;
+}
+
+/* MOUSE DEVFS NODE */
+
+static uint64_t ps2_mouse_devfs_read(vfs_node_t* node, uint64_t offset, uint64_t size, uint8_t* buf) {
+    (void) offset;
+    uint8_t port = (uintptr_t) node->link.ptr;
+    if(size < sizeof(ps2_mouse_report_t)) return 0; // reports cannot be split
+    if(!ps2_mouse_collect(port, (ps2_mouse_report_t*) buf)) return 0;
+    return sizeof(ps2_mouse_report_t);
+}
+
+static bool ps2_mouse_devfs_open(vfs_node_t* node, bool read, bool write) {
+    (void) node; (void) read;
+    return !write; // mice are read-only
+}
+
+static void ps2_mouse_devfs_close(vfs_node_t* node) {
+    (void) node;
+}
+
+static bool ps2_mouse_create_node(uint8_t port) {
+    vfs_node_t* devfs_root = vfs_traverse_path(NULL, "/dev");
+    if(devfs_root == NULL) {
+        kerror("cannot find devfs root");
+        return false;
+    }
+
+    char name[16];
+    for(size_t i = 0; i < 256; i++) {
+        ksprintf(name, "mouse%u", i); // /dev/mouseN
+        if(vfs_finddir(devfs_root, name) == NULL) {
+            ps2_mice[port].devfs_node = devfs_create(devfs_root, &ps2_mouse_devfs_read, NULL, &ps2_mouse_devfs_open, &ps2_mouse_devfs_close, NULL, false, sizeof(ps2_mouse_report_t), name);
+            if(ps2_mice[port].devfs_node == NULL) break;
+            ps2_mice[port].devfs_node->link.ptr = (void*) (uintptr_t) port;
+            kdebug("mouse on port %u is %s", port, name);
+            return true;
+        }
+    }
+
+    kerror("cannot create devfs node for mouse on port %u", port);
+    return false;
+}
+
+bool ps2_mouse_attach(uint8_t port, uint16_t id) {
+    struct ps2_mouse_status* mouse = &ps2_mice[port];
+    uintptr_t flags = ps2_irq_save();
+    mouse->id = id;
+    mouse->packet_len = (id == PS2_MOUSE_ID_STANDARD) ? 3 : 4; // wheel mice send an extra byte
+    mouse->packet_idx = 0;
+    memset(&mouse->accum, 0, sizeof(ps2_mouse_report_t));
+    mouse->enabled = true;
+    ps2_irq_restore(flags);
+
+    if(mouse->devfs_node == NULL) return ps2_mouse_create_node(port);
+    return true;
+}
+
+/* MOUSE PACKET HANDLING */
+
+static void ps2_mouse_handle_packet(uint8_t port, struct ps2_mouse_status* mouse) {
+    const uint8_t* pkt = mouse->packet;
+    uint32_t buttons = pkt[0] & (PS2_MOUSE_BTN_LEFT | PS2_MOUSE_BTN_RIGHT | PS2_MOUSE_BTN_MIDDLE);
+    int32_t dz = 0;
+    if(mouse->id == PS2_MOUSE_ID_WHEEL) dz = (int8_t) pkt[3];
+    else if(mouse->id == PS2_MOUSE_ID_5BTN) {
+        dz = (int8_t) (pkt[3] << 4) >> 4; // 4-bit signed value
+        if(pkt[3] & (1 << 4)) buttons |= PS2_MOUSE_BTN_4;
+        if(pkt[3] & (1 << 5)) buttons |= PS2_MOUSE_BTN_5;
+    }
+
+    /* coalesce with whatever hasn't been collected yet */
+    int32_t dx_prev = mouse->accum.dx, dy_prev = mouse->accum.dy;
+    if(!(pkt[0] & (PS2_MOUSE_PKT_XOVF | PS2_MOUSE_PKT_YOVF))) { // motion is meaningless on overflow
+        mouse->accum.dx += (int32_t) pkt[1] - ((pkt[0] & PS2_MOUSE_PKT_XSIGN) ? 0x100 : 0);
+        mouse->accum.dy += (int32_t) pkt[2] - ((pkt[0] & PS2_MOUSE_PKT_YSIGN) ? 0x100 : 0);
+    }
+    mouse->accum.dz += dz;
+
+    /* report packet on the event node too */
+    if(mouse->accum.dx != dx_prev) ps2_event_push(port, mouse->packet_ts, PS2_EV_REL, PS2_REL_X, mouse->accum.dx - dx_prev);
+    if(mouse->accum.dy != dy_prev) ps2_event_push(port, mouse->packet_ts, PS2_EV_REL, PS2_REL_Y, mouse->accum.dy - dy_prev);
+    if(dz) ps2_event_push(port, mouse->packet_ts, PS2_EV_REL, PS2_REL_WHEEL, dz);
+    for(uint16_t i = 0; i < 5; i++) {
+        if((buttons ^ mouse->accum.buttons) & (1 << i)) ps2_event_push(port, mouse->packet_ts, PS2_EV_BTN, i, (buttons >> i) & 1);
+    }
+    ps2_event_push(port, mouse->packet_ts, PS2_EV_SYN, PS2_SYN_REPORT, 0);
+
+    mouse->accum.buttons = buttons;
+    if(!mouse->accum.packets++) mouse->accum_ts = mouse->packet_ts;
+    ps2_lat_record(port, PS2_LAT_DELIVER, mouse->packet_ts);
+}
+
+void ps2_mouse_handle_byte(uint8_t port, uint8_t data, timer_tick_t ts) {
+    struct ps2_mouse_status* mouse = &ps2_mice[port];
+    if(!mouse->enabled) return;
+
+    if(mouse->packet_idx > 0 && ts - mouse->packet_ts > PS2_MOUSE_PACKET_TIMEOUT) mouse->packet_idx = 0; // stale partial packet
+    mouse->packet_ts = ts;
+
+    if(mouse->packet_idx == 0 && !(data & PS2_MOUSE_PKT_ALWAYS1)) {
+        mouse->desyncs++; // cannot be the first byte of a packet
+        return;
+    }
+
+    mouse->packet[mouse->packet_idx++] = data;
+    if(mouse->packet_idx == mouse->packet_len) {
+        ps2_mouse_handle_packet(port, mouse);
+        mouse->packet_idx = 0;
+    }
+}
+
+bool ps2_mouse_collect(uint8_t port, ps2_mouse_report_t* report) {
+    struct ps2_mouse_status* mouse = &ps2_mice[port];
+    if(!mouse->enabled) return false;
+
+    uintptr_t flags = ps2_irq_save();
+    memcpy(report, &mouse->accum, sizeof(ps2_mouse_report_t));
+    timer_tick_t ts = mouse->accum_ts;
+    mouse->accum.dx = 0; mouse->accum.dy = 0; mouse->accum.dz = 0; mouse->accum.packets = 0; // buttons reflect current state
+    ps2_irq_restore(flags);
+    if(report->packets) ps2_lat_record(port, PS2_LAT_READ, ts);
+    return true;
+}
+
+void ps2_mouse_stats(uint8_t port, size_t* desyncs) {
+    if(desyncs != NULL) *desyncs = ps2_mice[port].desyncs;
+}
@@ -0,0 +1,74 @@
+#ifndef PS2_MOUSE_H
+#define PS2_MOUSE_H
+
+#include <kmod.h>
+#include <hal/timer.h>
+
+/* mouse device IDs */
+#define PS2_MOUSE_ID_STANDARD       0x00
+#define PS2_MOUSE_ID_WHEEL          0x03 // IntelliMouse (scroll wheel)
+#define PS2_MOUSE_ID_5BTN           0x04 // IntelliMouse Explorer (scroll wheel + buttons 4/5)
+
+/* mouse device commands */
+#define PS2_DEVCMD_MOUSE_SET_RATE   0xF3 // set sample rate
+
+#define PS2_MOUSE_DEFAULT_RATE      100 // default sample rate (samples/sec)
+#define PS2_MOUSE_PACKET_TIMEOUT    50000UL // maximum gap between bytes of the same packet in microseconds
+
+/* mouse buttons */
+#define PS2_MOUSE_BTN_LEFT          (1 << 0)
+#define PS2_MOUSE_BTN_RIGHT         (1 << 1)
+#define PS2_MOUSE_BTN_MIDDLE        (1 << 2)
+#define PS2_MOUSE_BTN_4             (1 << 3)
+#define PS2_MOUSE_BTN_5             (1 << 4)
+
+/* motion report returned by reading the mouse's devfs node */
+typedef struct {
+    int32_t dx; // accumulated X motion since the last read (positive is right)
+    int32_t dy; // accumulated Y motion since the last read (positive is up, as reported by the device)
+    int32_t dz; // accumulated wheel motion since the last read
+    uint32_t buttons; // current button state (see PS2_MOUSE_BTN_*)
+    uint32_t packets; // number of packets coalesced into this report
+} __attribute__((packed)) ps2_mouse_report_t;
+
+/*
+ * bool ps2_mouse_is_mouse(uint16_t id)
+ *  Returns whether the specified device ID belongs to a supported mouse.
+ */
+bool ps2_mouse_is_mouse(uint16_t id);
+
+/*
+ * uint8_t ps2_mouse_rate(uint8_t port)
+ *  Returns the sample rate to be used for the mouse on the specified port,
+ *  taking the i8042_p#rate kernel cmdline override into account.
+ */
+uint8_t ps2_mouse_rate(uint8_t port);
+
+/*
+ * bool ps2_mouse_attach(uint8_t port, uint16_t id)
+ *  Resets packet assembly for the mouse on the specified port and creates
+ *  its devfs node (if it has not been created yet).
+ */
+bool ps2_mouse_attach(uint8_t port, uint16_t id);
+
+/*
+ * void ps2_mouse_handle_byte(uint8_t port, uint8_t data, timer_tick_t ts)
+ *  Assembles incoming bytes into packets and accumulates their motion.
+ *  Called from the IRQ handler.
+ */
+void ps2_mouse_handle_byte(uint8_t port, uint8_t data, timer_tick_t ts);
+
+/*
+ * bool ps2_mouse_collect(uint8_t port, ps2_mouse_report_t* report)
+ *  Retrieves and clears the motion accumulated on the specified port.
+ *  Returns false if no mouse is attached to the port.
+ */
+bool ps2_mouse_collect(uint8_t port, ps2_mouse_report_t* report);
+
+/*
+ * void ps2_mouse_stats(uint8_t port, size_t* desyncs)
+ *  Retrieves the number of bytes discarded to resynchronize packet assembly.
+ */
+void ps2_mouse_stats(uint8_t port, size_t* desyncs);
+
+#endif
@@ -102,6 +102,24 @@ static inline void ps2_send_data(uint8_t port, uint8_t data) {
     ps2_write_data(data);
 }
 
+/*
+ * static inline uintptr_t ps2_irq_save()
+ *  Disables interrupts and returns the previous EFLAGS value for ps2_irq_restore.
+ */
+static inline uintptr_t ps2_irq_save() {
+    uintptr_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/*
+ * static inline void ps2_irq_restore(uintptr_t flags)
+ *  Restores the interrupt state saved by ps2_irq_save.
+ */
+static inline void ps2_irq_restore(uintptr_t flags) {
+    asm volatile("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
 /* PS/2 device commands */
 #define PS2_DEVCMD_KBD_SET_LED                  0xED // set LEDs
 #define PS2_DEVCMD_KBD_ECHO                     0xEE
@@ -114,6 +132,11 @@ static inline void ps2_send_data(uint8_t port, uint8_t data) {
 #define PS2_DEVCMD_RESEND                       0xFE
 #define PS2_DEVCMD_RESET                        0xFF
 
+/* PS2_DEVCMD_KBD_SET_LED argument bits */
+#define PS2_KBD_LED_SCROLL                      (1 << 0)
+#define PS2_KBD_LED_NUM                         (1 << 1)
+#define PS2_KBD_LED_CAPS                        (1 << 2)
+
 /* PS/2 device responses */
 #define PS2_DEVRESP_BAT_OK                      0xAA // self-test passed
 #define PS2_DEVRESP_KBD_ECHO                    0xEE
@@ -0,0 +1,89 @@
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <fs/devfs.h>
+
+#include "ps2_io.h"
+#include "cmd.h"
+#include "mouse.h"
+#include "event.h"
+
+#define PS2_STATS_TEXT_LEN          2048 // maximum length of the text report
+
+static ps2_lat_stats_t ps2_lat_stats[2][PS2_LAT_PATHS]; // protected by disabling interrupts
+static const char* ps2_lat_path_names[PS2_LAT_PATHS] = {"deliver", "read"};
+
+void ps2_lat_record(uint8_t port, uint8_t path, timer_tick_t ts) {
+    timer_tick_t lat = timer_tick - ts;
+    size_t bucket = 0;
+    while(bucket < PS2_LAT_HIST_BUCKETS - 1 && (lat >> (bucket + 1))) bucket++; // floor(log2(lat))
+
+    uintptr_t flags = ps2_irq_save(); // we may be called from the IRQ handler too
+    ps2_lat_stats_t* stats = &ps2_lat_stats[port][path];
+    if(stats->count == 0 || lat < stats->min) stats->min = lat;
+    if(lat > stats->max) stats->max = lat;
+    stats->total += lat;
+    stats->count++;
+    stats->hist[bucket]++;
+    ps2_irq_restore(flags);
+}
+
+void ps2_lat_get(uint8_t port, uint8_t path, ps2_lat_stats_t* stats) {
+    uintptr_t flags = ps2_irq_save();
+    memcpy(stats, &ps2_lat_stats[port][path], sizeof(ps2_lat_stats_t));
+    ps2_irq_restore(flags);
+}
+
+/* STATISTICS DEVFS NODE */
+
+static size_t ps2_stats_format(char* buf) {
+    char* p = buf;
+    for(uint8_t port = 0; port < 2; port++) {
+        ksprintf(p, "port %u:\n", port); p += strlen(p);
+        for(uint8_t path = 0; path < PS2_LAT_PATHS; path++) {
+            ps2_lat_stats_t stats; ps2_lat_get(port, path, &stats);
+            ksprintf(p, "  %s: count %u, min %llu us, avg %llu us, max %llu us\n    hist:", ps2_lat_path_names[path], stats.count, (uint64_t) stats.min, (stats.count) ? (uint64_t) (stats.total / stats.count) : 0ULL, (uint64_t) stats.max); p += strlen(p);
+            for(size_t i = 0; i < PS2_LAT_HIST_BUCKETS; i++) { ksprintf(p, " %u", stats.hist[i]); p += strlen(p); } // bucket i: 2^i us and up
+            *(p++) = '\n';
+        }
+
+        size_t resends, timeouts, overflows, drops, desyncs;
+        ps2_cmd_stats(port, &resends, &timeouts);
+        ps2_data_stats(port, &overflows, &drops);
+        ps2_mouse_stats(port, &desyncs);
+        ksprintf(p, "  resends %u, timeouts %u, overflows %u, drops %u, desyncs %u, event drops %u\n", resends, timeouts, overflows, drops, desyncs, ps2_event_stats(port)); p += strlen(p);
+    }
+    return p - buf;
+}
+
+static uint64_t ps2_stats_devfs_read(vfs_node_t* node, uint64_t offset, uint64_t size, uint8_t* buf) {
+    (void) node;
+    char text[PS2_STATS_TEXT_LEN];
+    size_t len = ps2_stats_format(text); // regenerated on every read - readers are expected to read the whole thing at once
+    if(offset >= len) return 0;
+    if(offset + size > len) size = len - offset;
+    memcpy(buf, &text[offset], size);
+    return size;
+}
+
+static bool ps2_stats_devfs_open(vfs_node_t* node, bool read, bool write) {
+    (void) node; (void) read;
+    return !write; // read-only
+}
+
+static void ps2_stats_devfs_close(vfs_node_t* node) {
+    (void) node;
+}
+
+bool ps2_stats_init() {
+    vfs_node_t* devfs_root = vfs_traverse_path(NULL, "/dev");
+    if(devfs_root == NULL) {
+        kerror("cannot find devfs root");
+        return false;
+    }
+    if(devfs_create(devfs_root, &ps2_stats_devfs_read, NULL, &ps2_stats_devfs_open, &ps2_stats_devfs_close, NULL, false, 0, "i8042stats") == NULL) {
+        kerror("cannot create statistics devfs node");
+        return false;
+    }
+    return true;
+}
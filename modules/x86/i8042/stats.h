@@ -0,0 +1,43 @@
+#ifndef PS2_STATS_H
+#define PS2_STATS_H
+
+#include <kmod.h>
+#include <hal/timer.h>
+
+#define PS2_LAT_HIST_BUCKETS        16 // log2 histogram buckets (bucket i holds latencies of 2^i to 2^(i+1)-1 microseconds)
+
+/* latency measurement paths */
+#define PS2_LAT_DELIVER             0 // IRQ to delivery to the input layer (kbd_keypress, mouse packet accumulation)
+#define PS2_LAT_READ                1 // IRQ to delivery to a reader (devfs node read)
+#define PS2_LAT_PATHS               2
+
+typedef struct {
+    size_t count;
+    timer_tick_t min;
+    timer_tick_t max;
+    timer_tick_t total; // for calculating average
+    size_t hist[PS2_LAT_HIST_BUCKETS];
+} ps2_lat_stats_t;
+
+/*
+ * void ps2_lat_record(uint8_t port, uint8_t path, timer_tick_t ts)
+ *  Records the latency between the specified IRQ timestamp and now.
+ */
+void ps2_lat_record(uint8_t port, uint8_t path, timer_tick_t ts);
+
+/*
+ * void ps2_lat_get(uint8_t port, uint8_t path, ps2_lat_stats_t* stats)
+ *  Retrieves a consistent snapshot of the specified latency statistics.
+ */
+void ps2_lat_get(uint8_t port, uint8_t path, ps2_lat_stats_t* stats);
+
+/*
+ * bool ps2_stats_init()
+ *  Creates the /dev/i8042stats node, which reports latency statistics and
+ *  error counters for both ports as text.
+ */
+bool ps2_stats_init();
+
+void ps2_data_stats(uint8_t port, size_t* overflows, size_t* drops); // main.c
+
+#endif
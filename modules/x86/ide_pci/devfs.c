@@ -5,7 +5,7 @@
 #include "devtree_defs.h"
 #include "regs.h"
 
-#define ATA_IO_MAX_SECTORS                          256 // maximum number of sectors to access in one go (so that all tasks have a fairer chance of accessing the channel/drive)
+#define ATA_IO_MAX_SECTORS                          256 // maximum number of sectors to access in one go (so that the dispatcher in ioprio.c can let higher priority tasks in between)
 
 static int8_t ide_poll_channel(ide_channel_devtree_t* channel, bool check_status) {
     ide_delay(channel);
@@ -40,6 +40,60 @@ static uint8_t ata_io_commands[4] = { // bit 0: direction, bit 1: LBA48
     ATA_CMD_WRITE_PIO_EXT
 };
 
+/* selects the drive, writes the task file and issues a PIO read/write command for sec_cnt sectors starting from lba_start (channel must be acquired by the caller) */
+static void ide_ata_issue(ide_dev_devtree_t* dev, bool write, uint64_t lba_start, uint64_t sec_cnt) {
+    /* calculate parameters */
+    uint8_t lba_io[6] = {0, 0, 0, 0, 0, 0}, head = 0;
+    uint16_t cyl;
+    switch(dev->addressing) {
+        case ATA_ADDR_LBA48:
+            lba_io[0]   = (lba_start & 0x0000000000FF) >> 0;
+            lba_io[1]   = (lba_start & 0x00000000FF00) >> 8;
+            lba_io[2]   = (lba_start & 0x000000FF0000) >> 16;
+            lba_io[3]   = (lba_start & 0x0000FF000000) >> 24;
+            lba_io[4]   = (lba_start & 0x00FF00000000) >> 32;
+            lba_io[5]   = (lba_start & 0xFF0000000000) >> 40;
+            break;
+        case ATA_ADDR_LBA28:
+            lba_io[0]   = (lba_start & 0x00000FF) >> 0;
+            lba_io[1]   = (lba_start & 0x000FF00) >> 8;
+            lba_io[2]   = (lba_start & 0x0FF0000) >> 16;
+            head        = (lba_start & 0xF000000) >> 24;
+            break;
+        case ATA_ADDR_CHS:
+            lba_io[0]   = (lba_start % dev->sects) + 1;
+            cyl         = (lba_start + 1 - lba_io[0]) / (dev->cyls * dev->heads);
+            lba_io[1]   = (cyl & 0x00FF) >> 0;
+            lba_io[2]   = (cyl & 0xFF00) >> 8;
+            head        = (lba_start / dev->sects) % dev->heads;
+            break;
+    }
+
+    /* wait if drive is busy */
+    ide_channel_devtree_t* channel = (ide_channel_devtree_t*) dev->header.parent;
+    while(ide_read_byte(channel, IDE_REG_STAT) & IDE_SR_BSY)
+        task_yield_noirq(); // TODO: is this the right thing to do?
+
+    /* select drive and addressing mode, and also send head number over */
+    ide_write_byte(channel, IDE_REG_HDDEVSEL, IDE_HDSR_BASE | head | ((dev->drive) ? IDE_HDSR_DRV : 0) | ((dev->addressing == ATA_ADDR_CHS) ? 0 : IDE_HDSR_LBA));
+    if(channel->selected_drv != dev->drive) {
+        channel->selected_drv = dev->drive;
+        ide_delay(channel);
+    }
+
+    /* write parameters (this also sets nIEN) */
+    ide_write_taskfile(channel, (dev->irq_disable) ? IDE_CR_NIEN : 0, (dev->addressing == ATA_ADDR_LBA48), (uint16_t) sec_cnt, lba_io);
+
+    /* send command and begin operation */
+    if(!dev->irq_disable) {
+        if(!mutex_test(&channel->irq_block)) mutex_acquire(&channel->irq_block); // prepare for waiting
+    }
+    ide_write_byte(channel, IDE_REG_CMD, ata_io_commands[((write) ? (1 << 0) : 0) | ((dev->addressing == ATA_ADDR_LBA48) ? (1 << 1) : 0)]);
+    if(!dev->irq_disable) {
+        mutex_acquire(&channel->irq_block); // re-acquire IRQ (so we know when to continue)
+    }
+}
+
 static uint64_t ide_devfs_ata_stub(ide_dev_devtree_t* dev, bool write, uint64_t offset, uint64_t size, uint8_t* buf) {
     if(size == 0 || offset >= (dev->size << 9)) return 0; // nothing to be done here, period
 
@@ -111,67 +165,10 @@ static uint64_t ide_devfs_ata_stub(ide_dev_devtree_t* dev, bool write, uint64_t
 
     // kdebug("accessing %s: write=%u, offset=%llu, size=%llu -> LBA=%llu-%llu", dev->header.name, (write)?1:0, offset, size, lba_start, lba_end);
 
-    /* calculate parameters */
-    uint8_t lba_io[6] = {0, 0, 0, 0, 0, 0}, head = 0;
-    uint16_t cyl;
-    switch(dev->addressing) {
-        case ATA_ADDR_LBA48:
-            lba_io[0]   = (lba_start & 0x0000000000FF) >> 0;
-            lba_io[1]   = (lba_start & 0x00000000FF00) >> 8;
-            lba_io[2]   = (lba_start & 0x000000FF0000) >> 16;
-            lba_io[3]   = (lba_start & 0x0000FF000000) >> 24;
-            lba_io[4]   = (lba_start & 0x00FF00000000) >> 32;
-            lba_io[5]   = (lba_start & 0xFF0000000000) >> 40;
-            break;
-        case ATA_ADDR_LBA28:
-            lba_io[0]   = (lba_start & 0x00000FF) >> 0;
-            lba_io[1]   = (lba_start & 0x000FF00) >> 8;
-            lba_io[2]   = (lba_start & 0x0FF0000) >> 16;
-            head        = (lba_start & 0xF000000) >> 24;
-            break;
-        case ATA_ADDR_CHS:
-            lba_io[0]   = (lba_start % dev->sects) + 1;
-            cyl         = (lba_start + 1 - lba_io[0]) / (dev->cyls * dev->heads);
-            lba_io[1]   = (cyl & 0x00FF) >> 0;
-            lba_io[2]   = (cyl & 0xFF00) >> 8;
-            head        = (lba_start / dev->sects) % dev->heads;
-            break;
-    }
-
-    /* wait if drive is busy */
+    /* issue command */
     ide_channel_devtree_t* channel = (ide_channel_devtree_t*) dev->header.parent;
-    mutex_acquire(&channel->access); // wait until tasks have finished using this channel
-    while(ide_read_byte(channel, IDE_REG_STAT) & IDE_SR_BSY)
-        task_yield_noirq(); // TODO: is this the right thing to do?
-
-    /* select drive and addressing mode, and also send head number over */
-    ide_write_byte(channel, IDE_REG_HDDEVSEL, IDE_HDSR_BASE | head | ((dev->drive) ? IDE_HDSR_DRV : 0) | ((dev->addressing == ATA_ADDR_CHS) ? 0 : IDE_HDSR_LBA));
-    if(channel->selected_drv != dev->drive) {
-        channel->selected_drv = dev->drive;
-        ide_delay(channel);
-    }
-
-    /* write parameters */
-    if(dev->addressing == ATA_ADDR_LBA48) {
-        ide_write_byte(channel, IDE_REG_SECCNT1, (uint8_t) (sec_cnt >> 8));
-        ide_write_byte(channel, IDE_REG_LBA3, lba_io[3]);
-        ide_write_byte(channel, IDE_REG_LBA4, lba_io[4]);
-        ide_write_byte(channel, IDE_REG_LBA5, lba_io[5]);
-    }
-    ide_write_byte(channel, IDE_REG_SECCNT0, (uint8_t) (sec_cnt & 0xFF));
-    ide_write_byte(channel, IDE_REG_LBA0, lba_io[0]);
-    ide_write_byte(channel, IDE_REG_LBA1, lba_io[1]);
-    ide_write_byte(channel, IDE_REG_LBA2, lba_io[2]);
-
-    /* send command and begin operation */
-    ide_set_nien(dev, dev->irq_disable);
-    if(!dev->irq_disable) {
-        if(!mutex_test(&channel->irq_block)) mutex_acquire(&channel->irq_block); // prepare for waiting
-    }
-    ide_write_byte(channel, IDE_REG_CMD, ata_io_commands[((write) ? (1 << 0) : 0) | ((dev->addressing == ATA_ADDR_LBA48) ? (1 << 1) : 0)]);
-    if(!dev->irq_disable) {
-        mutex_acquire(&channel->irq_block); // re-acquire IRQ (so we know when to continue)
-    }
+    ide_channel_acquire(channel, sec_cnt); // wait until tasks have finished using this channel, and for our turn according to our I/O priority
+    ide_ata_issue(dev, write, lba_start, sec_cnt);
 
     /* poll drive after receiving interrupt */
     int8_t poll_ret; // polling result
@@ -226,10 +223,108 @@ done:
         ide_write_byte(channel, IDE_REG_CMD, (dev->addressing == ATA_ADDR_LBA48) ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
         ide_poll_channel(channel, false);
     }
-    mutex_release(&channel->access);
+    ide_channel_release(channel);
+    return ret;
+}
+
+/* scatter/gather cursor over an I/O vector */
+typedef struct {
+    const ide_iovec_t* iov;
+    size_t iovcnt;
+    size_t idx; // current fragment
+    uint64_t off; // offset within current fragment
+} ide_iov_cursor_t;
+
+static void ide_ata_xfer_sector_v(ide_channel_devtree_t* channel, bool write, ide_iov_cursor_t* cur) {
+    while(cur->idx < cur->iovcnt && cur->off >= cur->iov[cur->idx].len) { // skip exhausted (or empty) fragments
+        cur->idx++; cur->off = 0;
+    }
+
+    if(cur->idx < cur->iovcnt && cur->iov[cur->idx].len - cur->off >= 512) {
+        /* sector lies entirely within the current fragment - transfer it directly */
+        uint16_t* ptr = (uint16_t*) &cur->iov[cur->idx].base[cur->off];
+        if(write) ide_write_word_n(channel, IDE_REG_DATA, ptr, 256);
+        else ide_read_word_n(channel, IDE_REG_DATA, ptr, 256);
+        cur->off += 512;
+        return;
+    }
+
+    /* sector straddles fragment boundaries - go through a bounce buffer */
+    uint8_t sect_buf[512];
+    if(!write) ide_read_word_n(channel, IDE_REG_DATA, (uint16_t*) sect_buf, 256);
+    for(size_t done = 0; done < 512 && cur->idx < cur->iovcnt; ) {
+        uint64_t n = cur->iov[cur->idx].len - cur->off; if(n > 512 - done) n = 512 - done;
+        if(write) memcpy(&sect_buf[done], &cur->iov[cur->idx].base[cur->off], n);
+        else memcpy(&cur->iov[cur->idx].base[cur->off], &sect_buf[done], n);
+        done += n; cur->off += n;
+        while(cur->idx < cur->iovcnt && cur->off >= cur->iov[cur->idx].len) {
+            cur->idx++; cur->off = 0;
+        }
+    }
+    if(write) ide_write_word_n(channel, IDE_REG_DATA, (uint16_t*) sect_buf, 256);
+}
+
+static uint64_t ide_devfs_ata_stub_v(ide_dev_devtree_t* dev, bool write, uint64_t offset, const ide_iovec_t* iov, size_t iovcnt) {
+    uint64_t size = 0; // total number of bytes to be transferred
+    for(size_t i = 0; i < iovcnt; i++) size += iov[i].len;
+    if(size == 0 || offset >= (dev->size << 9)) return 0; // nothing to be done here, period
+
+    if((offset & 0x1FF) || (size & 0x1FF)) {
+        /* unaligned access - fall back to going through each fragment one by one */
+        uint64_t ret = 0;
+        for(size_t i = 0; i < iovcnt; i++) {
+            uint64_t iter_ret = ide_devfs_ata_stub(dev, write, offset, iov[i].len, iov[i].base);
+            ret += iter_ret; offset += iter_ret;
+            if(iter_ret != iov[i].len) break; // premature exit
+        }
+        return ret;
+    }
+
+    if(offset + size > (dev->size << 9)) size = (dev->size << 9) - offset; // cut off if we're attempting to access past the disk's size
+
+    uint64_t max_sects = (dev->addressing == ATA_ADDR_LBA48) ? UINT16_MAX : UINT8_MAX;
+    if(max_sects > ATA_IO_MAX_SECTORS) max_sects = ATA_IO_MAX_SECTORS;
+
+    ide_channel_devtree_t* channel = (ide_channel_devtree_t*) dev->header.parent;
+    ide_iov_cursor_t cur = {iov, iovcnt, 0, 0};
+    uint64_t ret = 0;
+    while(size > 0) {
+        /* access as many sectors as possible with one command - fragment boundaries don't matter to the drive */
+        uint64_t sec_cnt = size >> 9; if(sec_cnt > max_sects) sec_cnt = max_sects;
+        ide_channel_acquire(channel, sec_cnt);
+        ide_ata_issue(dev, write, offset >> 9, sec_cnt);
+
+        for(size_t i = 0; i < sec_cnt; i++) {
+            int8_t poll_ret = ide_poll_channel(channel, true);
+            if(poll_ret < 0) {
+                if(write && ret > 0) ret -= 512; // last write failed
+                kdebug("premature exit: ide_poll_channel returned %d -> returning %llu", poll_ret, ret);
+                size = 0; // stop after this command
+                break;
+            }
+            ide_ata_xfer_sector_v(channel, write, &cur);
+            ret += 512;
+        }
+
+        if(write) {
+            /* flush cache */
+            ide_write_byte(channel, IDE_REG_CMD, (dev->addressing == ATA_ADDR_LBA48) ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+            ide_poll_channel(channel, false);
+        }
+        ide_channel_release(channel);
+
+        if(size == 0) break;
+        size -= sec_cnt << 9; offset += sec_cnt << 9;
+    }
+
     return ret;
 }
 
+uint64_t ide_ata_access(ide_dev_devtree_t* dev, bool write, uint64_t offset, uint64_t size, uint8_t* buf) {
+    ide_iovec_t iov = {buf, size}; // single buffer accesses are just one-fragment vectors (unaligned ones are handed to ide_devfs_ata_stub from there)
+    return ide_devfs_ata_stub_v(dev, write, offset, &iov, 1);
+}
+
 uint64_t ide_devfs_read(vfs_node_t* node, uint64_t offset, uint64_t size, uint8_t* buf) {
     ide_dev_devtree_t* dev = node->link.ptr;
     kassert(dev != NULL);
@@ -244,7 +339,9 @@ uint64_t ide_devfs_read(vfs_node_t* node, uint64_t offset, uint64_t size, uint8_
         return 0;
     } else {
         /* ATA */
-        return ide_devfs_ata_stub(dev, false, offset, size, buf);
+        uint64_t ret = ide_ata_access(dev, false, offset, size, buf);
+        dev->stats.reads++; dev->stats.bytes_read += ret;
+        return ret;
     }
 }
 
@@ -260,7 +357,45 @@ uint64_t ide_devfs_write(vfs_node_t* node, uint64_t offset, uint64_t size, const
         return 0;
     } else {
         /* ATA */
-        return ide_devfs_ata_stub(dev, true, offset, size, (uint8_t*) buf);
+        uint64_t ret = ide_ata_access(dev, true, offset, size, (uint8_t*) buf);
+        dev->stats.writes++; dev->stats.bytes_written += ret;
+        return ret;
+    }
+}
+
+uint64_t ide_devfs_readv(vfs_node_t* node, uint64_t offset, const ide_iovec_t* iov, size_t iovcnt) {
+    ide_dev_devtree_t* dev = node->link.ptr;
+    kassert(dev != NULL && dev->header.size == sizeof(ide_dev_devtree_t) && dev->devfs_node == node);
+
+    if(!mutex_test(&dev->header.in_use)) return 0; // drive not opened yet
+
+    if(dev->type) {
+        /* ATAPI */
+        kdebug("reading from ATAPI drives is not supported yet");
+        return 0;
+    } else {
+        /* ATA */
+        uint64_t ret = ide_devfs_ata_stub_v(dev, false, offset, iov, iovcnt);
+        dev->stats.reads++; dev->stats.bytes_read += ret;
+        return ret;
+    }
+}
+
+uint64_t ide_devfs_writev(vfs_node_t* node, uint64_t offset, const ide_iovec_t* iov, size_t iovcnt) {
+    ide_dev_devtree_t* dev = node->link.ptr;
+    kassert(dev != NULL && dev->header.size == sizeof(ide_dev_devtree_t) && dev->devfs_node == node);
+
+    if(!mutex_test(&dev->header.in_use)) return 0; // drive not opened yet
+
+    if(dev->type) {
+        /* ATAPI */
+        kdebug("writing from ATAPI drives is not supported yet");
+        return 0;
+    } else {
+        /* ATA */
+        uint64_t ret = ide_devfs_ata_stub_v(dev, true, offset, iov, iovcnt);
+        dev->stats.writes++; dev->stats.bytes_written += ret;
+        return ret;
     }
 }
 
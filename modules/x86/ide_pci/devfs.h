@@ -4,8 +4,25 @@
 #include <kmod.h>
 #include <fs/devfs.h>
 
+#include "devtree_defs.h"
+
+/* I/O vector fragment for vectored (scatter/gather) access */
+typedef struct {
+    uint8_t* base;
+    uint64_t len;
+} ide_iovec_t;
+
+uint64_t ide_ata_access(ide_dev_devtree_t* dev, bool write, uint64_t offset, uint64_t size, uint8_t* buf); // raw ATA access (bypasses open checks), used by the devfs callbacks
+
 uint64_t ide_devfs_read(vfs_node_t* node, uint64_t offset, uint64_t size, uint8_t* buf);
 uint64_t ide_devfs_write(vfs_node_t* node, uint64_t offset, uint64_t size, const uint8_t* buf);
+/*
+ * vectored access for in-kernel callers (e.g. record-oriented readers in other modules), since devfs
+ * nodes only take single-buffer read/write callbacks; fills all fragments from contiguous sectors with
+ * one command where possible. ide_devfs_read/write go through the same path with a single fragment.
+ */
+uint64_t ide_devfs_readv(vfs_node_t* node, uint64_t offset, const ide_iovec_t* iov, size_t iovcnt);
+uint64_t ide_devfs_writev(vfs_node_t* node, uint64_t offset, const ide_iovec_t* iov, size_t iovcnt);
 bool ide_devfs_open(vfs_node_t* node, bool read, bool write);
 void ide_devfs_close(vfs_node_t* node);
 
@@ -7,6 +7,16 @@
 #include <fs/devfs.h>
 #include <helpers/mutex.h>
 
+#include "ioprio.h"
+
+/* I/O statistics (for accesses through a devfs node) */
+typedef struct {
+    uint64_t reads; // number of read calls
+    uint64_t writes; // number of write calls
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+} ide_io_stats_t;
+
 /* IDE device node */
 #define ATA_ADDR_CHS                    0
 #define ATA_ADDR_LBA28                  1
@@ -27,18 +37,33 @@ typedef struct {
     uint8_t irq_disable; // nIEN
     char model[41]; // drive model string
     vfs_node_t* devfs_node; // devfs node
+    ide_io_stats_t stats; // whole-disk node statistics
 } ide_dev_devtree_t;
 
+/* IDE partition node (child of the device node) */
+typedef struct {
+    devtree_t header;
+    uint8_t index; // partition number (1-4 for MBR primary, 5+ for MBR logical, 1+ for GPT)
+    uint8_t type; // MBR partition type (0xEE for GPT partitions)
+    uint64_t start; // first sector
+    uint64_t size; // in sectors
+    vfs_node_t* devfs_node; // devfs node
+    ide_io_stats_t stats;
+} ide_part_devtree_t;
+
 /* IDE channel node */
+#define IDE_NUM_REGS                    14 // number of IDE_REG_* registers
 typedef struct ide_channel_devtree {
     devtree_t header;
     uint16_t io_base; // IO
     uint16_t ctrl_base; // control
+    uint16_t ports[IDE_NUM_REGS]; // port number for each IDE_REG_* register (precomputed by ide_init_ports)
     uint16_t bmide_base; // bus master IDE
     uint8_t selected_drv; // last selected drive
     uint8_t irq_line; // IRQ line number (PIC IRQ/APIC GSI)
     mutex_t irq_block; // this mutex is acquired by the I/O function before waiting for interrupts, then released by the IRQ handler while the function re-acquires the mutex
-    mutex_t access; // mutex for blocking channel access
+    mutex_t access; // mutex for blocking channel access (use ide_channel_acquire/ide_channel_release)
+    volatile uint16_t io_waiting[IDE_IOPRIO_CLASSES]; // number of tasks of each I/O priority class waiting for the channel
     struct ide_channel_devtree* next; // next channel (all channels form a singly linked list)
 } ide_channel_devtree_t;
 
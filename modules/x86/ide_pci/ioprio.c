@@ -0,0 +1,213 @@
+#include "ioprio.h"
+#include <string.h>
+#include <fs/devfs.h>
+#include <exec/task.h>
+#include <hal/timer.h>
+
+#include "devtree_defs.h"
+
+#define IDE_IOPRIO_MAX_TASKS            16 // maximum number of tasks with non-default settings
+#define IDE_IOPRIO_STARVE_TIMEOUT       1000000UL // time (in microseconds) a lower class may be held back by higher ones before it's let through anyway
+
+typedef struct {
+    void* task; // NULL if the entry is unused
+    size_t opens; // number of times the task has /dev/ideprio open - the entry goes away on its last close
+    uint8_t class;
+    uint32_t bps_limit; // bytes per second (0 = unlimited)
+    uint32_t iops_limit; // commands per second (0 = unlimited)
+    int64_t bps_budget; // remaining byte budget (may go negative after a large command)
+    int64_t iops_budget; // remaining command budget
+    uint64_t bps_frac, iops_frac; // budget accrued since the last refill that doesn't add up to a whole unit yet (in units/1000000)
+    timer_tick_t tick_refill; // last time the budgets were refilled
+} ide_ioprio_t;
+
+static ide_ioprio_t ide_ioprio_tasks[IDE_IOPRIO_MAX_TASKS];
+static mutex_t ide_ioprio_lock;
+
+static ide_ioprio_t* ide_ioprio_find(void* task) {
+    for(size_t i = 0; i < IDE_IOPRIO_MAX_TASKS; i++) {
+        if(ide_ioprio_tasks[i].task == task) return &ide_ioprio_tasks[i];
+    }
+    return NULL;
+}
+
+/* resets an entry to the default settings (ide_ioprio_lock must be held) */
+static void ide_ioprio_reset(ide_ioprio_t* prio, uint8_t class, uint32_t bps_limit, uint32_t iops_limit) {
+    prio->class = class;
+    prio->bps_limit = bps_limit; prio->bps_budget = bps_limit;
+    prio->iops_limit = iops_limit; prio->iops_budget = iops_limit;
+    prio->bps_frac = 0; prio->iops_frac = 0;
+    prio->tick_refill = timer_tick;
+}
+
+bool ide_ioprio_set(void* task, uint8_t class, uint32_t bps_limit, uint32_t iops_limit) {
+    if(task == NULL || class >= IDE_IOPRIO_CLASSES) return false;
+
+    mutex_acquire(&ide_ioprio_lock);
+    ide_ioprio_t* prio = ide_ioprio_find(task);
+    if(prio == NULL) {
+        prio = ide_ioprio_find(NULL); // allocate new entry
+        if(prio != NULL) prio->opens = 0;
+    }
+    if(prio == NULL) {
+        mutex_release(&ide_ioprio_lock);
+        kerror("no space left for I/O priority settings of task 0x%x", (uintptr_t) task);
+        return false;
+    }
+    ide_ioprio_reset(prio, class, bps_limit, iops_limit);
+    prio->task = task;
+    mutex_release(&ide_ioprio_lock);
+
+    kdebug("task 0x%x: I/O class %u, %u bytes/sec, %u IOPS", (uintptr_t) task, class, bps_limit, iops_limit);
+    return true;
+}
+
+void ide_ioprio_clear(void* task) {
+    if(task == NULL) return;
+    mutex_acquire(&ide_ioprio_lock);
+    ide_ioprio_t* prio = ide_ioprio_find(task);
+    if(prio != NULL) {
+        if(prio->opens) ide_ioprio_reset(prio, IDE_IOPRIO_BE, 0, 0); // keep the entry until the task closes /dev/ideprio
+        else prio->task = NULL;
+    }
+    mutex_release(&ide_ioprio_lock);
+}
+
+/* adds limit * elapsed microseconds' worth of budget, carrying over the fractional part so that frequent refills don't lose time */
+static void ide_ioprio_refill(int64_t* budget, uint64_t* frac, uint32_t limit, timer_tick_t elapsed) {
+    if(!limit) return;
+    uint64_t credit = (uint64_t) limit * elapsed + *frac;
+    *budget += (int64_t) (credit / 1000000UL); *frac = credit % 1000000UL;
+    if(*budget >= (int64_t) limit) {
+        *budget = limit; *frac = 0; // allow bursts of up to 1 second's worth
+    }
+}
+
+/* refills the current task's budgets according to the time elapsed, and returns whether it may issue another command */
+static bool ide_ioprio_budget_ok(void* task) {
+    mutex_acquire(&ide_ioprio_lock);
+    ide_ioprio_t* prio = ide_ioprio_find(task);
+    bool ok = true;
+    if(prio != NULL) {
+        timer_tick_t elapsed = timer_tick - prio->tick_refill;
+        prio->tick_refill += elapsed;
+        ide_ioprio_refill(&prio->bps_budget, &prio->bps_frac, prio->bps_limit, elapsed);
+        ide_ioprio_refill(&prio->iops_budget, &prio->iops_frac, prio->iops_limit, elapsed);
+        ok = (!prio->bps_limit || prio->bps_budget > 0) && (!prio->iops_limit || prio->iops_budget > 0);
+    }
+    mutex_release(&ide_ioprio_lock);
+    return ok;
+}
+
+/* checks if there are tasks of a higher class than the specified one waiting on the channel */
+static inline bool ide_ioprio_preempted(ide_channel_devtree_t* channel, uint8_t class) {
+    for(uint8_t c = 0; c < class; c++) {
+        if(__atomic_load_n(&channel->io_waiting[c], __ATOMIC_ACQUIRE)) return true;
+    }
+    return false;
+}
+
+void ide_channel_acquire(ide_channel_devtree_t* channel, uint64_t sec_cnt) {
+    void* task = (void*) task_current;
+    mutex_acquire(&ide_ioprio_lock);
+    ide_ioprio_t* prio = ide_ioprio_find(task); // NULL = best-effort with no budget
+    uint8_t class = (prio != NULL) ? prio->class : IDE_IOPRIO_BE;
+    mutex_release(&ide_ioprio_lock);
+
+    /* wait for budget to become available */
+    while(!ide_ioprio_budget_ok(task)) task_yield_noirq();
+
+    /* wait for our turn */
+    __atomic_add_fetch(&channel->io_waiting[class], 1, __ATOMIC_RELEASE);
+    timer_tick_t t_start = timer_tick;
+    while(1) {
+        bool starved = (timer_tick - t_start >= IDE_IOPRIO_STARVE_TIMEOUT);
+        if(starved || !ide_ioprio_preempted(channel, class)) {
+            mutex_acquire(&channel->access);
+            if(starved || !ide_ioprio_preempted(channel, class)) break; // a higher class task may have come in while we were waiting for the channel
+            mutex_release(&channel->access);
+        }
+        task_yield_noirq();
+    }
+    __atomic_sub_fetch(&channel->io_waiting[class], 1, __ATOMIC_RELEASE);
+
+    /* charge the command to the task's budgets (looked up again, as the entry may have changed while we were waiting) */
+    mutex_acquire(&ide_ioprio_lock);
+    prio = ide_ioprio_find(task);
+    if(prio != NULL) {
+        prio->bps_budget -= (int64_t) (sec_cnt << 9);
+        prio->iops_budget--;
+    }
+    mutex_release(&ide_ioprio_lock);
+}
+
+void ide_channel_release(ide_channel_devtree_t* channel) {
+    mutex_release(&channel->access);
+}
+
+/* SETTINGS DEVFS NODE */
+
+/* reads return the calling task's settings, writes change them (class IDE_IOPRIO_DEFAULT reverts to the defaults) */
+static uint64_t ide_ioprio_devfs_read(vfs_node_t* node, uint64_t offset, uint64_t size, uint8_t* buf) {
+    (void) node;
+    if(offset >= sizeof(ide_ioprio_req_t)) return 0;
+    ide_ioprio_req_t req = {IDE_IOPRIO_BE, 0, 0};
+    mutex_acquire(&ide_ioprio_lock);
+    ide_ioprio_t* prio = ide_ioprio_find((void*) task_current);
+    if(prio != NULL) {
+        req.class = prio->class; req.bps_limit = prio->bps_limit; req.iops_limit = prio->iops_limit;
+    }
+    mutex_release(&ide_ioprio_lock);
+    if(offset + size > sizeof(ide_ioprio_req_t)) size = sizeof(ide_ioprio_req_t) - offset;
+    memcpy(buf, (uint8_t*) &req + offset, size);
+    return size;
+}
+
+static uint64_t ide_ioprio_devfs_write(vfs_node_t* node, uint64_t offset, uint64_t size, const uint8_t* buf) {
+    (void) node; (void) offset;
+    if(size < sizeof(ide_ioprio_req_t)) return 0; // requests cannot be split
+    ide_ioprio_req_t req; memcpy(&req, buf, sizeof(ide_ioprio_req_t));
+    if(req.class == IDE_IOPRIO_DEFAULT) ide_ioprio_clear((void*) task_current);
+    else if(req.class >= IDE_IOPRIO_CLASSES || !ide_ioprio_set((void*) task_current, req.class, req.bps_limit, req.iops_limit)) return 0; // check the class before it's narrowed down
+    return sizeof(ide_ioprio_req_t);
+}
+
+/* settings made through the node only last while the task has it open, so that tasks that are gone don't keep (or pass on) their entries */
+static bool ide_ioprio_devfs_open(vfs_node_t* node, bool read, bool write) {
+    (void) read; (void) write;
+    void* task = (void*) task_current;
+    mutex_acquire(&ide_ioprio_lock);
+    ide_ioprio_t* prio = ide_ioprio_find(task);
+    if(prio == NULL) {
+        prio = ide_ioprio_find(NULL); // allocate new entry with the default settings
+        if(prio != NULL) {
+            ide_ioprio_reset(prio, IDE_IOPRIO_BE, 0, 0);
+            prio->opens = 0; prio->task = task;
+        }
+    }
+    if(prio != NULL) prio->opens++;
+    mutex_release(&ide_ioprio_lock);
+    if(prio == NULL) kwarn("no space left for I/O priority settings - cannot open %s", node->name);
+    return (prio != NULL);
+}
+
+static void ide_ioprio_devfs_close(vfs_node_t* node) {
+    (void) node;
+    mutex_acquire(&ide_ioprio_lock);
+    ide_ioprio_t* prio = ide_ioprio_find((void*) task_current);
+    if(prio != NULL && prio->opens && --prio->opens == 0) prio->task = NULL; // back to the defaults
+    mutex_release(&ide_ioprio_lock);
+}
+
+bool ide_ioprio_init() {
+    vfs_node_t* devfs_root = vfs_traverse_path(NULL, "/dev");
+    if(devfs_root == NULL) {
+        kerror("cannot find devfs root");
+        return false;
+    }
+    if(devfs_create(devfs_root, &ide_ioprio_devfs_read, &ide_ioprio_devfs_write, &ide_ioprio_devfs_open, &ide_ioprio_devfs_close, NULL, false, sizeof(ide_ioprio_req_t), "ideprio") == NULL) {
+        kerror("cannot create I/O priority devfs node");
+        return false;
+    }
+    return true;
+}
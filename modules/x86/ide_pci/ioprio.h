@@ -0,0 +1,56 @@
+#ifndef IDE_IOPRIO_H
+#define IDE_IOPRIO_H
+
+#include <kmod.h>
+
+/* I/O priority classes */
+#define IDE_IOPRIO_RT                   0 // realtime - always dispatched first
+#define IDE_IOPRIO_BE                   1 // best-effort (default for tasks without an entry)
+#define IDE_IOPRIO_IDLE                 2 // idle - only dispatched when no other class is waiting
+#define IDE_IOPRIO_CLASSES              3
+#define IDE_IOPRIO_DEFAULT              0xFF // revert to the default settings (for /dev/ideprio)
+
+/* record written to/read from /dev/ideprio - applies to the calling task */
+typedef struct {
+    uint32_t class; // IDE_IOPRIO_*
+    uint32_t bps_limit; // bytes per second (0 = unlimited)
+    uint32_t iops_limit; // commands per second (0 = unlimited)
+} __attribute__((packed)) ide_ioprio_req_t;
+
+struct ide_channel_devtree;
+
+/*
+ * bool ide_ioprio_set(void* task, uint8_t class, uint32_t bps_limit, uint32_t iops_limit)
+ *  Sets the I/O priority class of the specified task, along with its optional
+ *  bandwidth (bytes/sec) and IOPS (commands/sec) budgets (0 = unlimited).
+ *  Returns false if the class is invalid or there's no space left for another task.
+ */
+bool ide_ioprio_set(void* task, uint8_t class, uint32_t bps_limit, uint32_t iops_limit);
+
+/*
+ * void ide_ioprio_clear(void* task)
+ *  Reverts the specified task to the default (best-effort, unlimited) settings.
+ *  Settings made by tasks through /dev/ideprio are also cleared when they close it.
+ */
+void ide_ioprio_clear(void* task);
+
+/*
+ * bool ide_ioprio_init()
+ *  Creates the /dev/ideprio node through which tasks can set their own I/O priority settings.
+ */
+bool ide_ioprio_init();
+
+/*
+ * void ide_channel_acquire(struct ide_channel_devtree* channel, uint64_t sec_cnt)
+ *  Waits until the current task may issue a command of sec_cnt sectors on the
+ *  channel according to its priority class and budgets, then acquires the channel.
+ */
+void ide_channel_acquire(struct ide_channel_devtree* channel, uint64_t sec_cnt);
+
+/*
+ * void ide_channel_release(struct ide_channel_devtree* channel)
+ *  Releases the channel acquired by ide_channel_acquire.
+ */
+void ide_channel_release(struct ide_channel_devtree* channel);
+
+#endif
@@ -11,6 +11,8 @@
 #include "regs.h"
 #include "devfs.h"
 #include "irq.h"
+#include "part.h"
+#include "stats.h"
 
 /* fallback IO and control bases */
 #define IDE_PRI_IO_BASE                 0x1F0
@@ -269,6 +271,8 @@ static bool ide_init(pci_devtree_t* dev) {
             if(bar) channels[ch].bmide_base = (bar & ~((1 << 0) | (1 << 1))) + ((ch) ? 8 : 0);
         }
 
+        ide_init_ports(&channels[ch]);
+
         kdebug(" - %s: IO base 0x%x, control port 0x%x, bus master IDE base 0x%x", channels[ch].header.name, channels[ch].io_base, channels[ch].ctrl_base, channels[ch].bmide_base);
         devtree_add_child((devtree_t*) dev, (devtree_t*) &channels[ch]);
 
@@ -337,6 +341,16 @@ static bool ide_init(pci_devtree_t* dev) {
         }
     }
 
+    /* scan partition tables (once interrupts are set up, so reads go through the normal path) */
+    kdebug(" - scanning partitions");
+    for(size_t ch = 0; ch < 2; ch++) {
+        ide_dev_devtree_t* drive = (ide_dev_devtree_t*) channels[ch].header.first_child;
+        while(drive != NULL) {
+            if(!drive->type) kdebug("    - %s: %u partition(s)", drive->devfs_node->name, ide_scan_partitions(drive));
+            drive = (ide_dev_devtree_t*) drive->header.next_sibling;
+        }
+    }
+
     /* test all drives */
     kdebug(" - testing drives");
     for(size_t ch = 0; ch < 2; ch++) {
@@ -390,6 +404,8 @@ int32_t kmod_init(elf_prgload_t* load_result, size_t load_result_len) {
         return -2;
     }
     kinfo("%u IDE controller(s) detected on PCI bus", detected);
+    ide_ioprio_init();
+    ide_stats_init();
 
     // while(1);
 
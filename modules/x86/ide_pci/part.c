@@ -0,0 +1,191 @@
+#include "part.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "devfs.h"
+
+/* PARTITION DEVFS NODE CALLBACKS */
+
+/* clamps an access to the partition's bounds, returning the number of bytes that can be accessed */
+static inline uint64_t ide_part_clamp(ide_part_devtree_t* part, uint64_t offset, uint64_t size) {
+    uint64_t part_bytes = part->size << 9;
+    if(offset >= part_bytes) return 0;
+    if(size > part_bytes - offset) size = part_bytes - offset;
+    return size;
+}
+
+uint64_t ide_part_devfs_read(vfs_node_t* node, uint64_t offset, uint64_t size, uint8_t* buf) {
+    ide_part_devtree_t* part = node->link.ptr;
+    kassert(part != NULL && part->header.size == sizeof(ide_part_devtree_t) && part->devfs_node == node);
+
+    if(!mutex_test(&part->header.in_use)) return 0; // partition not opened yet
+
+    size = ide_part_clamp(part, offset, size);
+    if(size == 0) return 0;
+    uint64_t ret = ide_ata_access((ide_dev_devtree_t*) part->header.parent, false, (part->start << 9) + offset, size, buf);
+    part->stats.reads++; part->stats.bytes_read += ret;
+    return ret;
+}
+
+uint64_t ide_part_devfs_write(vfs_node_t* node, uint64_t offset, uint64_t size, const uint8_t* buf) {
+    ide_part_devtree_t* part = node->link.ptr;
+    kassert(part != NULL && part->header.size == sizeof(ide_part_devtree_t) && part->devfs_node == node);
+
+    if(!mutex_test(&part->header.in_use)) return 0; // partition not opened yet
+
+    size = ide_part_clamp(part, offset, size);
+    if(size == 0) return 0;
+    uint64_t ret = ide_ata_access((ide_dev_devtree_t*) part->header.parent, true, (part->start << 9) + offset, size, (uint8_t*) buf);
+    part->stats.writes++; part->stats.bytes_written += ret;
+    return ret;
+}
+
+bool ide_part_devfs_open(vfs_node_t* node, bool read, bool write) {
+    (void) read; (void) write; // TODO: consider these params
+
+    ide_part_devtree_t* part = node->link.ptr;
+    kassert(part != NULL && part->header.size == sizeof(ide_part_devtree_t) && part->devfs_node == node);
+
+    if(!mutex_test(&part->header.in_use)) mutex_acquire(&part->header.in_use);
+    else kdebug("partition %s is already opened", node->name);
+
+    return true;
+}
+
+void ide_part_devfs_close(vfs_node_t* node) {
+    ide_part_devtree_t* part = node->link.ptr;
+    kassert(part != NULL && part->header.size == sizeof(ide_part_devtree_t) && part->devfs_node == node);
+
+    if(mutex_test(&part->header.in_use)) mutex_release(&part->header.in_use);
+    else kdebug("partition %s is already closed", node->name);
+}
+
+/* PARTITION TABLE PARSING */
+
+static bool ide_add_partition(ide_dev_devtree_t* dev, vfs_node_t* devfs_root, uint8_t index, uint8_t type, uint64_t start, uint64_t size) {
+    if(size == 0 || start >= dev->size || size > dev->size - start) {
+        kwarn("%s: partition %u (start %llu, %llu sectors) lies outside of the disk - ignoring", dev->devfs_node->name, index, start, size);
+        return false;
+    }
+
+    ide_part_devtree_t* part = kcalloc(1, sizeof(ide_part_devtree_t));
+    if(part == NULL) {
+        kerror("cannot allocate memory for partition %u of %s", index, dev->devfs_node->name);
+        return false;
+    }
+    part->header.size = sizeof(ide_part_devtree_t);
+    ksprintf(part->header.name, "p%u", index);
+    part->index = index; part->type = type;
+    part->start = start; part->size = size;
+
+    char name[32]; ksprintf(name, "%s%u", dev->devfs_node->name, index); // e.g. /dev/hda1
+    part->devfs_node = devfs_create(devfs_root, &ide_part_devfs_read, &ide_part_devfs_write, &ide_part_devfs_open, &ide_part_devfs_close, NULL, true, size * 512, name);
+    if(part->devfs_node == NULL) {
+        kerror("cannot create devfs node for partition %u of %s", index, dev->devfs_node->name);
+        kfree(part);
+        return false;
+    }
+    part->devfs_node->link.ptr = part; // link back to partition
+    devtree_add_child((devtree_t*) dev, (devtree_t*) part);
+
+    kdebug("    - %s: type 0x%02x, start %llu, %llu sectors", part->devfs_node->name, type, start, size);
+    return true;
+}
+
+static size_t ide_scan_gpt(ide_dev_devtree_t* dev, vfs_node_t* devfs_root) {
+    uint8_t buf[512];
+    if(ide_ata_access(dev, false, 1 << 9, 512, buf) != 512) {
+        kerror("%s: cannot read GPT header", dev->devfs_node->name);
+        return 0;
+    }
+    gpt_header_t* hdr = (gpt_header_t*) buf;
+    if(memcmp(hdr->signature, "EFI PART", 8)) {
+        kwarn("%s: protective MBR found, but GPT header is invalid", dev->devfs_node->name);
+        return 0;
+    }
+    if(hdr->entry_size < sizeof(gpt_entry_t) || hdr->entry_size > 512 || (512 % hdr->entry_size)) {
+        kwarn("%s: unsupported GPT entry size %u", dev->devfs_node->name, hdr->entry_size);
+        return 0;
+    }
+
+    uint64_t entries_lba = hdr->entries_lba;
+    uint32_t num_entries = hdr->num_entries, entry_size = hdr->entry_size;
+    if(num_entries > IDE_PART_MAX) num_entries = IDE_PART_MAX;
+
+    size_t found = 0;
+    for(uint32_t i = 0; i < num_entries; i++) {
+        if((i * entry_size) % 512 == 0) {
+            /* read the next sector of entries */
+            if(ide_ata_access(dev, false, (entries_lba + (i * entry_size) / 512) << 9, 512, buf) != 512) {
+                kerror("%s: cannot read GPT partition entries", dev->devfs_node->name);
+                break;
+            }
+        }
+        gpt_entry_t* entry = (gpt_entry_t*) &buf[(i * entry_size) % 512];
+        bool used = false;
+        for(size_t j = 0; j < 16; j++) used |= (entry->type_guid[j] != 0);
+        if(!used || entry->last_lba < entry->first_lba) continue;
+        if(ide_add_partition(dev, devfs_root, i + 1, MBR_TYPE_GPT_PROTECTIVE, entry->first_lba, entry->last_lba - entry->first_lba + 1)) found++;
+    }
+
+    return found;
+}
+
+static size_t ide_scan_ebr(ide_dev_devtree_t* dev, vfs_node_t* devfs_root, uint64_t ext_start) {
+    uint8_t buf[512];
+    size_t found = 0;
+    uint64_t ebr = ext_start;
+    for(uint8_t index = 5; index < IDE_PART_MAX; index++) { // logical partitions are numbered from 5
+        if(ide_ata_access(dev, false, ebr << 9, 512, buf) != 512 || *((uint16_t*) &buf[MBR_SIGNATURE_OFFSET]) != MBR_SIGNATURE) {
+            kwarn("%s: invalid EBR at LBA %llu", dev->devfs_node->name, ebr);
+            break;
+        }
+        mbr_entry_t* entries = (mbr_entry_t*) &buf[MBR_TABLE_OFFSET];
+        if(entries[0].type != MBR_TYPE_EMPTY && ide_add_partition(dev, devfs_root, index, entries[0].type, ebr + entries[0].lba_start, entries[0].sectors)) found++; // relative to this EBR
+        if(entries[1].type == MBR_TYPE_EMPTY || entries[1].lba_start == 0) break; // end of chain
+        ebr = ext_start + entries[1].lba_start; // next EBR is relative to the extended partition
+    }
+    return found;
+}
+
+size_t ide_scan_partitions(ide_dev_devtree_t* dev) {
+    if(dev->type) return 0; // ATA only
+
+    vfs_node_t* devfs_root = vfs_traverse_path(NULL, "/dev");
+    if(devfs_root == NULL) {
+        kerror("cannot find devfs root");
+        return 0;
+    }
+
+    uint8_t buf[512];
+    if(ide_ata_access(dev, false, 0, 512, buf) != 512) {
+        kerror("%s: cannot read MBR", dev->devfs_node->name);
+        return 0;
+    }
+    if(*((uint16_t*) &buf[MBR_SIGNATURE_OFFSET]) != MBR_SIGNATURE) {
+        kdebug("%s: no partition table", dev->devfs_node->name);
+        return 0;
+    }
+
+    mbr_entry_t entries[4]; memcpy(entries, &buf[MBR_TABLE_OFFSET], sizeof(entries)); // buf will be reused for GPT/EBR
+    for(size_t i = 0; i < 4; i++) {
+        if(entries[i].type == MBR_TYPE_GPT_PROTECTIVE) return ide_scan_gpt(dev, devfs_root);
+    }
+
+    size_t found = 0;
+    for(size_t i = 0; i < 4; i++) {
+        switch(entries[i].type) {
+            case MBR_TYPE_EMPTY: break;
+            case MBR_TYPE_EXT_CHS:
+            case MBR_TYPE_EXT_LBA:
+            case MBR_TYPE_EXT_LINUX:
+                found += ide_scan_ebr(dev, devfs_root, entries[i].lba_start);
+                break;
+            default:
+                if(ide_add_partition(dev, devfs_root, i + 1, entries[i].type, entries[i].lba_start, entries[i].sectors)) found++;
+                break;
+        }
+    }
+    return found;
+}
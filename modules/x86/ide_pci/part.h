@@ -0,0 +1,71 @@
+#ifndef IDE_PART_H
+#define IDE_PART_H
+
+#include <kmod.h>
+#include <fs/devfs.h>
+
+#include "devtree_defs.h"
+
+/* MBR partition table entry */
+typedef struct {
+    uint8_t status;
+    uint8_t chs_first[3];
+    uint8_t type;
+    uint8_t chs_last[3];
+    uint32_t lba_start;
+    uint32_t sectors;
+} __attribute__((packed)) mbr_entry_t;
+
+#define MBR_TABLE_OFFSET                0x1BE
+#define MBR_SIGNATURE_OFFSET            0x1FE
+#define MBR_SIGNATURE                   0xAA55
+
+#define MBR_TYPE_EMPTY                  0x00
+#define MBR_TYPE_EXT_CHS                0x05 // extended partition
+#define MBR_TYPE_EXT_LBA                0x0F
+#define MBR_TYPE_EXT_LINUX              0x85
+#define MBR_TYPE_GPT_PROTECTIVE         0xEE
+
+/* GPT header */
+typedef struct {
+    char signature[8]; // must be EFI PART
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc;
+    uint32_t reserved;
+    uint64_t current_lba;
+    uint64_t backup_lba;
+    uint64_t first_usable;
+    uint64_t last_usable;
+    uint8_t disk_guid[16];
+    uint64_t entries_lba; // starting LBA of partition entries array
+    uint32_t num_entries;
+    uint32_t entry_size;
+    uint32_t entries_crc;
+} __attribute__((packed)) gpt_header_t;
+
+/* GPT partition entry */
+typedef struct {
+    uint8_t type_guid[16]; // all zeros for unused entries
+    uint8_t unique_guid[16];
+    uint64_t first_lba;
+    uint64_t last_lba; // inclusive
+    uint64_t attribs;
+    uint16_t name[36]; // UTF-16LE
+} __attribute__((packed)) gpt_entry_t;
+
+#define IDE_PART_MAX                    128 // maximum number of partitions per drive
+
+/*
+ * size_t ide_scan_partitions(ide_dev_devtree_t* dev)
+ *  Parses the MBR (and GPT, if there's a protective MBR) of the specified ATA drive
+ *  and creates a devfs node for each partition found. Returns the number of partitions.
+ */
+size_t ide_scan_partitions(ide_dev_devtree_t* dev);
+
+uint64_t ide_part_devfs_read(vfs_node_t* node, uint64_t offset, uint64_t size, uint8_t* buf);
+uint64_t ide_part_devfs_write(vfs_node_t* node, uint64_t offset, uint64_t size, const uint8_t* buf);
+bool ide_part_devfs_open(vfs_node_t* node, bool read, bool write);
+void ide_part_devfs_close(vfs_node_t* node);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <arch/x86cpu/asm.h>
 
 #include "devtree_defs.h"
@@ -74,94 +75,87 @@
 #define ATA_ID_CMDSETS                  164
 #define ATA_ID_MAX_LBA_EXT              200
 
+/* string I/O helpers for moving whole blocks of words between a port and memory */
+static inline void ide_insw(uint16_t port, uint16_t* buf, size_t word_len) {
+    asm volatile("rep insw" : "+D"(buf), "+c"(word_len) : "d"(port) : "memory");
+}
+
+static inline void ide_outsw(uint16_t port, const uint16_t* buf, size_t word_len) {
+    asm volatile("rep outsw" : "+S"(buf), "+c"(word_len) : "d"(port) : "memory");
+}
+
+#define IDE_REG_IS_HOB(reg)             ((reg) >= IDE_REG_SECCNT1 && (reg) <= IDE_REG_LBA5) // overlapped registers only accessible with HOB set
+
+/* precomputes the port number of each IDE_REG_* register (must be called once io_base and ctrl_base are known) */
+static inline void ide_init_ports(ide_channel_devtree_t* channel) {
+    for(uint16_t reg = 0; reg < IDE_NUM_REGS; reg++) {
+        if(reg < IDE_REG_SECCNT1)
+            channel->ports[reg] = channel->io_base + reg;
+        else if(reg < IDE_REG_CTRL)
+            channel->ports[reg] = channel->io_base - (IDE_REG_SECCNT1 - IDE_REG_SECCNT0) + reg;
+        else
+            channel->ports[reg] = channel->ctrl_base - (IDE_REG_CTRL - 2) + reg;
+    }
+}
+
 static inline void ide_write_byte(ide_channel_devtree_t* channel, uint16_t reg, uint8_t val) {
-    if(reg >= IDE_REG_SECCNT1 && reg <= IDE_REG_LBA5) // access overlapped regs
-        ide_write_byte(channel, IDE_REG_CTRL, IDE_CR_HOB);
-    if(reg < IDE_REG_SECCNT1)
-        outb(channel->io_base + reg, val);
-    else if(reg < IDE_REG_CTRL)
-        outb(channel->io_base - (IDE_REG_SECCNT1 - IDE_REG_SECCNT0) + reg, val);
-    else if(reg <= IDE_REG_DEVADDR)
-        outb(channel->ctrl_base - (IDE_REG_CTRL - 2) + reg, val);
-    if(reg >= IDE_REG_SECCNT1 && reg <= IDE_REG_LBA5)
-        ide_write_byte(channel, IDE_REG_CTRL, 0);
+    if(IDE_REG_IS_HOB(reg)) outb(channel->ports[IDE_REG_CTRL], IDE_CR_HOB); // access overlapped regs
+    outb(channel->ports[reg], val);
+    if(IDE_REG_IS_HOB(reg)) outb(channel->ports[IDE_REG_CTRL], 0);
 }
 
 static inline void ide_write_word(ide_channel_devtree_t* channel, uint16_t reg, uint16_t val) {
-    if(reg >= IDE_REG_SECCNT1 && reg <= IDE_REG_LBA5) // access overlapped regs
-        ide_write_byte(channel, IDE_REG_CTRL, IDE_CR_HOB);
-    if(reg < IDE_REG_SECCNT1)
-        outw(channel->io_base + reg, val);
-    else if(reg < IDE_REG_CTRL)
-        outw(channel->io_base - (IDE_REG_SECCNT1 - IDE_REG_SECCNT0) + reg, val);
-    else if(reg <= IDE_REG_DEVADDR)
-        outw(channel->ctrl_base - (IDE_REG_CTRL - 2) + reg, val);
-    if(reg >= IDE_REG_SECCNT1 && reg <= IDE_REG_LBA5)
-        ide_write_byte(channel, IDE_REG_CTRL, 0);
+    if(IDE_REG_IS_HOB(reg)) outb(channel->ports[IDE_REG_CTRL], IDE_CR_HOB); // access overlapped regs
+    outw(channel->ports[reg], val);
+    if(IDE_REG_IS_HOB(reg)) outb(channel->ports[IDE_REG_CTRL], 0);
 }
 
 static inline uint8_t ide_read_byte(ide_channel_devtree_t* channel, uint16_t reg) {
-    if(reg >= IDE_REG_SECCNT1 && reg <= IDE_REG_LBA5) // access overlapped regs
-        ide_write_byte(channel, IDE_REG_CTRL, IDE_CR_HOB);
-    uint8_t ret = 0;
-    if(reg < IDE_REG_SECCNT1)
-        ret = inb(channel->io_base + reg);
-    else if(reg < IDE_REG_CTRL)
-        ret = inb(channel->io_base - (IDE_REG_SECCNT1 - IDE_REG_SECCNT0) + reg);
-    else if(reg <= IDE_REG_DEVADDR)
-        ret = inb(channel->ctrl_base - (IDE_REG_CTRL - 2) + reg);
-    if(reg >= IDE_REG_SECCNT1 && reg <= IDE_REG_LBA5)
-        ide_write_byte(channel, IDE_REG_CTRL, 0);
+    if(IDE_REG_IS_HOB(reg)) outb(channel->ports[IDE_REG_CTRL], IDE_CR_HOB); // access overlapped regs
+    uint8_t ret = inb(channel->ports[reg]);
+    if(IDE_REG_IS_HOB(reg)) outb(channel->ports[IDE_REG_CTRL], 0);
     return ret;
 }
 
 static inline uint16_t ide_read_word(ide_channel_devtree_t* channel, uint16_t reg) {
-    if(reg >= IDE_REG_SECCNT1 && reg <= IDE_REG_LBA5) // access overlapped regs
-        ide_write_byte(channel, IDE_REG_CTRL, IDE_CR_HOB);
-    uint16_t ret = 0;
-    if(reg < IDE_REG_SECCNT1)
-        ret = inw(channel->io_base + reg);
-    else if(reg < IDE_REG_CTRL)
-        ret = inw(channel->io_base - (IDE_REG_SECCNT1 - IDE_REG_SECCNT0) + reg);
-    else if(reg <= IDE_REG_DEVADDR)
-        ret = inw(channel->ctrl_base - (IDE_REG_CTRL - 2) + reg);
-    if(reg >= IDE_REG_SECCNT1 && reg <= IDE_REG_LBA5)
-        ide_write_byte(channel, IDE_REG_CTRL, 0);
+    if(IDE_REG_IS_HOB(reg)) outb(channel->ports[IDE_REG_CTRL], IDE_CR_HOB); // access overlapped regs
+    uint16_t ret = inw(channel->ports[reg]);
+    if(IDE_REG_IS_HOB(reg)) outb(channel->ports[IDE_REG_CTRL], 0);
     return ret;
 }
 
 static inline void ide_write_word_n(ide_channel_devtree_t* channel, uint16_t reg, const uint16_t* buf, size_t word_len) {
-    if(reg >= IDE_REG_SECCNT1 && reg <= IDE_REG_LBA5) // access overlapped regs
-        ide_write_byte(channel, IDE_REG_CTRL, IDE_CR_HOB);
-    if(reg < IDE_REG_SECCNT1)
-        reg = channel->io_base + reg;
-    else if(reg < IDE_REG_CTRL)
-        reg = channel->io_base - (IDE_REG_SECCNT1 - IDE_REG_SECCNT0) + reg;
-    else if(reg <= IDE_REG_DEVADDR)
-        reg = channel->ctrl_base - (IDE_REG_CTRL - 2) + reg;
-    for(size_t i = 0; i < word_len; i++) outw(reg, buf[i]); // TODO: using outsw might be better
-    if(reg >= IDE_REG_SECCNT1 && reg <= IDE_REG_LBA5)
-        ide_write_byte(channel, IDE_REG_CTRL, 0);
+    if(IDE_REG_IS_HOB(reg)) outb(channel->ports[IDE_REG_CTRL], IDE_CR_HOB); // access overlapped regs
+    ide_outsw(channel->ports[reg], buf, word_len);
+    if(IDE_REG_IS_HOB(reg)) outb(channel->ports[IDE_REG_CTRL], 0);
 }
 
 static inline uint16_t* ide_read_word_n(ide_channel_devtree_t* channel, uint16_t reg, uint16_t* buf, size_t word_len) {
-    if(reg >= IDE_REG_SECCNT1 && reg <= IDE_REG_LBA5) // access overlapped regs
-        ide_write_byte(channel, IDE_REG_CTRL, IDE_CR_HOB);
-    if(reg < IDE_REG_SECCNT1)
-        reg = channel->io_base + reg;
-    else if(reg < IDE_REG_CTRL)
-        reg = channel->io_base - (IDE_REG_SECCNT1 - IDE_REG_SECCNT0) + reg;
-    else if(reg <= IDE_REG_DEVADDR)
-        reg = channel->ctrl_base - (IDE_REG_CTRL - 2) + reg;
+    if(IDE_REG_IS_HOB(reg)) outb(channel->ports[IDE_REG_CTRL], IDE_CR_HOB); // access overlapped regs
     if(buf != NULL)
-        for(size_t i = 0; i < word_len; i++) buf[i] = inw(reg); // TODO: using insw might be better
+        ide_insw(channel->ports[reg], buf, word_len);
     else
-        for(size_t i = 0; i < word_len; i++) inw(reg); // read to nowhere (i.e. discard)
-    if(reg >= IDE_REG_SECCNT1 && reg <= IDE_REG_LBA5)
-        ide_write_byte(channel, IDE_REG_CTRL, 0);
+        for(size_t i = 0; i < word_len; i++) inw(channel->ports[reg]); // read to nowhere (i.e. discard)
+    if(IDE_REG_IS_HOB(reg)) outb(channel->ports[IDE_REG_CTRL], 0);
     return buf;
 }
 
+/* writes sector count and LBA registers in one batch (HOB is set once for all LBA48 high bytes, then cleared for the low bytes), leaving ctrl in the control register */
+static inline void ide_write_taskfile(ide_channel_devtree_t* channel, uint8_t ctrl, bool lba48, uint16_t sec_cnt, const uint8_t* lba_io) {
+    if(lba48) {
+        outb(channel->ports[IDE_REG_CTRL], ctrl | IDE_CR_HOB);
+        outb(channel->ports[IDE_REG_SECCNT1], (uint8_t) (sec_cnt >> 8));
+        outb(channel->ports[IDE_REG_LBA3], lba_io[3]);
+        outb(channel->ports[IDE_REG_LBA4], lba_io[4]);
+        outb(channel->ports[IDE_REG_LBA5], lba_io[5]);
+    }
+    outb(channel->ports[IDE_REG_CTRL], ctrl);
+    outb(channel->ports[IDE_REG_SECCNT0], (uint8_t) (sec_cnt & 0xFF));
+    outb(channel->ports[IDE_REG_LBA0], lba_io[0]);
+    outb(channel->ports[IDE_REG_LBA1], lba_io[1]);
+    outb(channel->ports[IDE_REG_LBA2], lba_io[2]);
+}
+
 static inline void ide_delay(ide_channel_devtree_t* channel) {
     for(size_t i = 0; i < 4; i++) ide_read_byte(channel, IDE_REG_ALTSTAT); // 400ns delay (TODO: improve this)
 }
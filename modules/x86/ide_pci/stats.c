@@ -0,0 +1,80 @@
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fs/devfs.h>
+
+#include "devtree_defs.h"
+#include "irq.h"
+
+#define IDE_STATS_LINE_LEN              128 // maximum length of each line of the text report
+
+/* STATISTICS DEVFS NODE */
+
+static char* ide_stats_line(char* p, const char* name, const ide_io_stats_t* stats) {
+    ksprintf(p, "%s: reads %llu (%llu bytes), writes %llu (%llu bytes)\n", name, stats->reads, stats->bytes_read, stats->writes, stats->bytes_written);
+    return p + strlen(p);
+}
+
+/* returns the number of lines in the report */
+static size_t ide_stats_count() {
+    size_t lines = 0;
+    for(ide_channel_devtree_t* channel = ide_first_channel; channel != NULL; channel = channel->next) {
+        for(ide_dev_devtree_t* dev = (ide_dev_devtree_t*) channel->header.first_child; dev != NULL; dev = (ide_dev_devtree_t*) dev->header.next_sibling) {
+            if(dev->devfs_node == NULL) continue;
+            lines++;
+            for(devtree_t* part = dev->header.first_child; part != NULL; part = part->next_sibling) lines++;
+        }
+    }
+    return lines;
+}
+
+static size_t ide_stats_format(char* buf) {
+    char* p = buf;
+    for(ide_channel_devtree_t* channel = ide_first_channel; channel != NULL; channel = channel->next) {
+        for(ide_dev_devtree_t* dev = (ide_dev_devtree_t*) channel->header.first_child; dev != NULL; dev = (ide_dev_devtree_t*) dev->header.next_sibling) {
+            if(dev->devfs_node == NULL) continue;
+            p = ide_stats_line(p, dev->devfs_node->name, &dev->stats);
+            for(ide_part_devtree_t* part = (ide_part_devtree_t*) dev->header.first_child; part != NULL; part = (ide_part_devtree_t*) part->header.next_sibling)
+                p = ide_stats_line(p, part->devfs_node->name, &part->stats);
+        }
+    }
+    return p - buf;
+}
+
+static uint64_t ide_stats_devfs_read(vfs_node_t* node, uint64_t offset, uint64_t size, uint8_t* buf) {
+    (void) node;
+    char* text = kmalloc(ide_stats_count() * IDE_STATS_LINE_LEN + 1);
+    if(text == NULL) {
+        kerror("cannot allocate memory for statistics report");
+        return 0;
+    }
+    size_t len = ide_stats_format(text); // regenerated on every read - readers are expected to read the whole thing at once
+    if(offset >= len) size = 0;
+    else if(offset + size > len) size = len - offset;
+    memcpy(buf, &text[offset], size);
+    kfree(text);
+    return size;
+}
+
+static bool ide_stats_devfs_open(vfs_node_t* node, bool read, bool write) {
+    (void) node; (void) read;
+    return !write; // read-only
+}
+
+static void ide_stats_devfs_close(vfs_node_t* node) {
+    (void) node;
+}
+
+bool ide_stats_init() {
+    vfs_node_t* devfs_root = vfs_traverse_path(NULL, "/dev");
+    if(devfs_root == NULL) {
+        kerror("cannot find devfs root");
+        return false;
+    }
+    if(devfs_create(devfs_root, &ide_stats_devfs_read, NULL, &ide_stats_devfs_open, &ide_stats_devfs_close, NULL, false, 0, "idestats") == NULL) {
+        kerror("cannot create statistics devfs node");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,13 @@
+#ifndef IDE_STATS_H
+#define IDE_STATS_H
+
+#include <kmod.h>
+
+/*
+ * bool ide_stats_init()
+ *  Creates the /dev/idestats node, which reports the I/O statistics of every
+ *  disk and partition devfs node.
+ */
+bool ide_stats_init();
+
+#endif
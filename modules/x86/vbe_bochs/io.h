@@ -8,6 +8,10 @@
 #define VBE_DISPI_IOPORT_INDEX              0x01CE
 #define VBE_DISPI_IOPORT_DATA               0x01CF
 
+/* MMIO BAR (BAR2 of newer BGA/stdvga devices) */
+#define VBE_DISPI_MMIO_SIZE                 4096
+#define VBE_DISPI_MMIO_OFFSET               0x500 // DISPI registers, 16 bits each in index order
+
 /* indexes */
 #define VBE_DISPI_INDEX_ID                  0
 #define VBE_DISPI_INDEX_XRES                1
@@ -43,12 +47,19 @@
 #define VBE_DISPI_BPP_24                    0x18
 #define VBE_DISPI_BPP_32                    0x20
 
+extern volatile uint16_t* vbe_dispi_mmio; // DISPI registers in the MMIO BAR, NULL if port I/O is to be used (defined in main.c)
+
 static inline void vbe_write_reg(uint16_t index, uint16_t data) {
+    if(vbe_dispi_mmio != NULL) {
+        vbe_dispi_mmio[index] = data; // single access instead of two port writes
+        return;
+    }
     outw(VBE_DISPI_IOPORT_INDEX, index);
     outw(VBE_DISPI_IOPORT_DATA, data);
 }
 
 static inline uint16_t vbe_read_reg(uint16_t index) {
+    if(vbe_dispi_mmio != NULL) return vbe_dispi_mmio[index];
     outw(VBE_DISPI_IOPORT_INDEX, index);
     return inw(VBE_DISPI_IOPORT_DATA);
 }
@@ -1,32 +1,196 @@
 #include <kmod.h>
 #include <mm/vmm.h>
+#include <mm/pmm.h>
 #include <mm/addr.h>
 #include <stdlib.h>
 #include <string.h>
 #include <drivers/pci.h>
 #include <hal/fbuf.h>
+#include <hal/timer.h>
+#define FBMEM_IMPL
+#include <fbmem.h>
+#include <fbdev.h>
+#include <fballoc.h>
 #include "io.h"
 
 /* default (fallback) resolution */
 #define VBE_FALLBACK_WIDTH                      640
 #define VBE_FALLBACK_HEIGHT                     480
 
+#define VBE_MAX_PAGES                           3 // maximum number of VRAM pages for page flipping (triple buffering)
+
 static pci_devtree_t* vbe_devtree_node = NULL;
 
+volatile uint16_t* vbe_dispi_mmio = NULL; // declared in io.h
+
 static fbuf_t vbe_fbuf_impl;
 static uintptr_t vbe_fbuf_base;
 static size_t vbe_fbuf_size;
 
+/* double buffering */
+static void* vbe_shadow = NULL; // copy of what has last been flipped to the framebuffer (used to find damaged spans)
+static size_t vbe_force_y1 = 0, vbe_force_y2 = 0; // range of lines to be flipped regardless of damage (framebuffer contents unknown)
+
+/*
+ * page flipping: drawing still happens in the RAM backbuffer, and each flip writes the lines that a hidden VRAM page
+ * is missing into it before showing it - a line is missing if it has changed at a later flip than the page was last shown
+ */
+static size_t vbe_pages = 1; // number of VRAM pages in use (1 = page flipping disabled)
+static size_t vbe_page_front = 0; // page currently being displayed
+static uint32_t* vbe_line_gen = NULL; // flip generation at which each line last changed
+static uint32_t vbe_page_gen[VBE_MAX_PAGES]; // flip generation each page is up to date with
+static uint32_t vbe_flip_gen = 0; // number of flips that have changed anything
+
+static void vbe_force_flip(size_t y1, size_t y2) {
+    if(vbe_force_y1 == vbe_force_y2) {
+        vbe_force_y1 = y1; vbe_force_y2 = y2;
+    } else {
+        if(y1 < vbe_force_y1) vbe_force_y1 = y1;
+        if(y2 > vbe_force_y2) vbe_force_y2 = y2;
+    }
+}
+
+/*
+ * in double buffering mode, VRAM is treated as a ring of vbe_ring_lines lines followed by a mirror of its first
+ * (screen height) lines, so that the visible window starting at any ring line is always contiguous:
+ * screen line y lives at ring line (vbe_ring_origin + y) % vbe_ring_lines, which is mirrored if it's below the screen height
+ */
+static size_t vbe_ring_lines = 0; // 0 if there's not enough VRAM for hardware scrolling
+static size_t vbe_ring_origin = 0; // ring line at the top of the screen (i.e. Y offset)
+
+static void vbe_flip_span(fbuf_t* impl, size_t y, size_t off, size_t len) {
+    size_t line = (vbe_ring_lines) ? ((vbe_ring_origin + y) % vbe_ring_lines) : y;
+    const uint8_t* src = (const uint8_t*) impl->backbuffer + y * impl->pitch + off;
+    fbmem_copy_vram((void*) (vbe_fbuf_base + line * impl->pitch + off), src, len);
+    if(vbe_ring_lines && line < impl->height) fbmem_copy_vram((void*) (vbe_fbuf_base + (line + vbe_ring_lines) * impl->pitch + off), src, len); // mirror
+}
+
+static void vbe_flip(fbuf_t* impl) {
+    size_t words = impl->pitch / 4; // pitch is a multiple of 4
+    size_t flipped = 0;
+    for(size_t y = 0; y < impl->height; y++) {
+        uint32_t* src = (uint32_t*) ((uintptr_t) impl->backbuffer + y * impl->pitch);
+        uint32_t* shadow = (uint32_t*) ((uintptr_t) vbe_shadow + y * impl->pitch);
+
+        /* find damaged span of this line */
+        size_t x1 = 0, x2 = words;
+        if((y < vbe_force_y1 || y >= vbe_force_y2) && !fbmem_diff32(src, shadow, words, &x1, &x2)) continue; // line is intact
+
+        vbe_flip_span(impl, y, x1 * 4, (x2 - x1) * 4);
+        memcpy(&shadow[x1], &src[x1], (x2 - x1) * 4);
+        flipped += (x2 - x1) * 4;
+    }
+    vbe_force_y1 = vbe_force_y2 = 0;
+    fbdev_flip_account(flipped);
+}
+
+/* records the damaged lines, then brings the next hidden page up to date from the backbuffer (never reading VRAM) and shows it */
+static void vbe_flip_pages(fbuf_t* impl) {
+    size_t words = impl->pitch / 4;
+    bool damaged = false;
+    for(size_t y = 0; y < impl->height; y++) {
+        uint32_t* src = (uint32_t*) ((uintptr_t) impl->backbuffer + y * impl->pitch);
+        uint32_t* shadow = (uint32_t*) ((uintptr_t) vbe_shadow + y * impl->pitch);
+        size_t x1 = 0, x2 = words;
+        if((y < vbe_force_y1 || y >= vbe_force_y2) && !fbmem_diff32(src, shadow, words, &x1, &x2)) continue; // line is intact
+        memcpy(&shadow[x1], &src[x1], (x2 - x1) * 4);
+        vbe_line_gen[y] = vbe_flip_gen + 1;
+        damaged = true;
+    }
+    vbe_force_y1 = vbe_force_y2 = 0;
+    if(!damaged) return; // the page on screen is up to date already
+
+    vbe_flip_gen++;
+    size_t back = (vbe_page_front + 1) % vbe_pages;
+    uintptr_t page = vbe_fbuf_base + back * impl->pitch * impl->height;
+    size_t flipped = 0;
+    for(size_t y = 0; y < impl->height; y++) {
+        if(vbe_line_gen[y] <= vbe_page_gen[back]) continue; // page has this line already
+        fbmem_copy_vram((void*) (page + y * impl->pitch), (const void*) ((uintptr_t) impl->backbuffer + y * impl->pitch), impl->pitch);
+        flipped += impl->pitch;
+    }
+    vbe_page_gen[back] = vbe_flip_gen;
+    vbe_page_front = back;
+    vbe_write_reg(VBE_DISPI_INDEX_Y_OFFSET, back * impl->height);
+    impl->framebuffer = (void*) page;
+    fbdev_flip_account(flipped);
+}
+
+/* maps the DISPI registers through BAR2 if the device has it - expects the BGA version from port I/O for verification */
+static void vbe_dispi_map(uint16_t vbe_id) {
+    uint32_t bar = pci_cfg_read_dword(vbe_devtree_node->bus, vbe_devtree_node->dev, vbe_devtree_node->func, PCI_CFG_H0_BAR2);
+    if((bar & 1) || !(bar & 0xFFFFFFF0)) {
+        kdebug("no MMIO BAR - using port I/O for DISPI registers");
+        return;
+    }
+    uintptr_t mmio = vmm_alloc_map(vmm_kernel, bar & 0xFFFFFFF0, VBE_DISPI_MMIO_SIZE, kernel_end, UINTPTR_MAX, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_GLOBAL | VMM_FLAGS_RW); // uncached
+    if(!mmio) {
+        kwarn("cannot map MMIO BAR - using port I/O for DISPI registers");
+        return;
+    }
+    volatile uint16_t* regs = (volatile uint16_t*) (mmio + VBE_DISPI_MMIO_OFFSET);
+    if(regs[VBE_DISPI_INDEX_ID] != vbe_id) {
+        kwarn("MMIO BAR does not contain DISPI registers - using port I/O");
+        vmm_unmap(vmm_kernel, mmio, VBE_DISPI_MMIO_SIZE);
+        return;
+    }
+    vbe_dispi_mmio = regs;
+    kdebug("DISPI registers mapped at 0x%x (paddr 0x%x)", vbe_dispi_mmio, (bar & 0xFFFFFFF0) + VBE_DISPI_MMIO_OFFSET);
+}
+
 static bool vbe_unload_handler(fbuf_t* impl) {
-    vmm_unmap(vmm_kernel, (uintptr_t) impl->framebuffer, impl->pitch * impl->height); // unmap framebuffer from memory
+    if(!fbdev_unregister()) return false; // buffers are still in use by userland
+    vmm_unmap(vmm_kernel, vbe_fbuf_base, vbe_fbuf_size); // unmap framebuffer from memory
+    if(vbe_dispi_mmio != NULL) {
+        uintptr_t mmio = (uintptr_t) vbe_dispi_mmio - VBE_DISPI_MMIO_OFFSET;
+        vbe_dispi_mmio = NULL; // back to port I/O
+        vmm_unmap(vmm_kernel, mmio, VBE_DISPI_MMIO_SIZE);
+    }
+    if(impl->backbuffer != NULL) {
+        fballoc_free(impl->backbuffer, impl->pitch * impl->height);
+        fballoc_free(vbe_shadow, impl->pitch * impl->height);
+    }
+    if(vbe_line_gen != NULL) kfree(vbe_line_gen);
     return true;
 }
 
+/* moves the ring origin in double buffering mode */
+static void vbe_ring_scroll(fbuf_t* impl, size_t lines, bool up) {
+    if(!vbe_ring_lines) {
+        vbe_force_flip(0, impl->height); // no hardware scrolling - redraw everything from the backbuffer
+        return;
+    }
+    lines %= vbe_ring_lines;
+    vbe_ring_origin = (vbe_ring_origin + ((up) ? lines : (vbe_ring_lines - lines))) % vbe_ring_lines;
+
+    /* draw the exposed lines into the ring while they're still off screen, so that stale ring contents never get displayed */
+    size_t flipped = 0;
+    for(size_t y = vbe_force_y1; y < vbe_force_y2; y++) {
+        vbe_flip_span(impl, y, 0, impl->pitch);
+        memcpy((void*) ((uintptr_t) vbe_shadow + y * impl->pitch), (void*) ((uintptr_t) impl->backbuffer + y * impl->pitch), impl->pitch);
+        flipped += impl->pitch;
+    }
+    vbe_force_y1 = vbe_force_y2 = 0;
+    fbdev_flip_account(flipped);
+
+    vbe_write_reg(VBE_DISPI_INDEX_Y_OFFSET, vbe_ring_origin);
+    impl->framebuffer = (void*) (vbe_fbuf_base + vbe_ring_origin * impl->pitch);
+}
+
 static void vbe_scroll_up(fbuf_t* impl, size_t lines) {
+    if(impl->backbuffer != NULL) {
+        /* scroll backbuffer and shadow, then move the ring origin - only the newly exposed lines need to be drawn */
+        memmove(impl->backbuffer, (void*) ((uintptr_t) impl->backbuffer + lines * impl->pitch), impl->pitch * (impl->height - lines));
+        memmove(vbe_shadow, (void*) ((uintptr_t) vbe_shadow + lines * impl->pitch), impl->pitch * (impl->height - lines));
+        vbe_force_flip(impl->height - lines, impl->height);
+        vbe_ring_scroll(impl, lines, true);
+        return;
+    }
+
     uintptr_t new_ptr = (uintptr_t) impl->framebuffer + lines * impl->pitch; // new framebuffer ptr
     if(new_ptr + impl->pitch * impl->height > vbe_fbuf_base + vbe_fbuf_size) {
         /* framebuffer overrun - reset to top */
-        memmove((void*) vbe_fbuf_base, (void*) new_ptr, impl->pitch * (impl->height - lines));
+        fbmem_move_vram((void*) vbe_fbuf_base, (void*) new_ptr, impl->pitch * (impl->height - lines));
         vbe_write_reg(VBE_DISPI_INDEX_Y_OFFSET, 0);
         impl->framebuffer = (void*) vbe_fbuf_base;
     } else {
@@ -37,11 +201,19 @@ static void vbe_scroll_up(fbuf_t* impl, size_t lines) {
 }
 
 static void vbe_scroll_down(fbuf_t* impl, size_t lines) {
+    if(impl->backbuffer != NULL) {
+        memmove((void*) ((uintptr_t) impl->backbuffer + lines * impl->pitch), impl->backbuffer, impl->pitch * (impl->height - lines));
+        memmove((void*) ((uintptr_t) vbe_shadow + lines * impl->pitch), vbe_shadow, impl->pitch * (impl->height - lines));
+        vbe_force_flip(0, lines);
+        vbe_ring_scroll(impl, lines, false);
+        return;
+    }
+
     uintptr_t new_ptr = (uintptr_t) impl->framebuffer - lines * impl->pitch; // new framebuffer ptr
     if(new_ptr < vbe_fbuf_base) {
         /* we can't go any further */
         new_ptr = vbe_fbuf_base;
-        memmove((void*) new_ptr, impl->framebuffer, (impl->height - lines) * impl->pitch);
+        fbmem_move_vram((void*) new_ptr, impl->framebuffer, (impl->height - lines) * impl->pitch);
     }
     vbe_write_reg(VBE_DISPI_INDEX_Y_OFFSET, (new_ptr - vbe_fbuf_base) / impl->pitch);
     impl->framebuffer = (void*) new_ptr;
@@ -78,6 +250,7 @@ int32_t kmod_init(elf_prgload_t* load_result, size_t load_result_len) {
 
     vbe_fbuf_impl.elf_segments = load_result; vbe_fbuf_impl.num_elf_segments = load_result_len;
     vbe_fbuf_impl.unload = &vbe_unload_handler;
+    fbmem_init();
 
     kinfo("Bochs Graphics Adapter driver for SysX");
 
@@ -121,7 +294,7 @@ int32_t kmod_init(elf_prgload_t* load_result, size_t load_result_len) {
         case 24: vbe_fbuf_impl.type = FBUF_24BPP_BGR888; vbe_fbuf_impl.pitch = mode_w * 3; break;
         case 32: vbe_fbuf_impl.type = FBUF_32BPP_RGB888; vbe_fbuf_impl.pitch = mode_w * 4; break;
     }
-    vbe_fbuf_impl.backbuffer = NULL; vbe_fbuf_impl.flip = NULL; // TODO: double buffering
+    vbe_fbuf_impl.backbuffer = NULL; vbe_fbuf_impl.flip = NULL;
     vbe_fbuf_impl.scroll_up = &vbe_scroll_up; vbe_fbuf_impl.scroll_down = &vbe_scroll_down;
 
     /* map framebuffer */
@@ -138,7 +311,67 @@ int32_t kmod_init(elf_prgload_t* load_result, size_t load_result_len) {
     }
     vbe_fbuf_impl.framebuffer = (void*) vbe_fbuf_base;
 
+    /* check for page flipping request in cmdline */
+    size_t fb_size = vbe_fbuf_impl.pitch * vbe_fbuf_impl.height;
+    const char* pages_override = cmdline_find_kvp("vbe_pages");
+    if(pages_override != NULL) {
+        vbe_pages = strtoul(pages_override, NULL, 10);
+        if(vbe_pages > VBE_MAX_PAGES) vbe_pages = VBE_MAX_PAGES;
+        if(vbe_pages > vbe_fbuf_size / fb_size) vbe_pages = vbe_fbuf_size / fb_size;
+        if(vbe_pages < 2) {
+            kwarn("not enough VRAM for page flipping");
+            vbe_pages = 1;
+        }
+    }
+
+    /* allocate backbuffer and shadow copy for double buffering */
+    vbe_fbuf_impl.backbuffer = fballoc_alloc(fb_size);
+    if(vbe_fbuf_impl.backbuffer != NULL) {
+        vbe_shadow = fballoc_alloc(fb_size);
+        if(vbe_shadow == NULL) {
+            fballoc_free(vbe_fbuf_impl.backbuffer, fb_size);
+            vbe_fbuf_impl.backbuffer = NULL;
+        }
+    }
+    if(vbe_fbuf_impl.backbuffer != NULL && vbe_pages > 1) {
+        vbe_line_gen = kcalloc(vbe_fbuf_impl.height, sizeof(uint32_t));
+        if(vbe_line_gen == NULL) {
+            kwarn("cannot allocate line damage record - page flipping will be unavailable");
+            vbe_pages = 1;
+        }
+    }
+    if(vbe_fbuf_impl.backbuffer == NULL) vbe_pages = 1; // pages are filled from the backbuffer
+    if(vbe_pages > 1) {
+        /* flip by changing Y offset, so that the screen only ever shows complete frames */
+        kinfo("using %u VRAM pages for page flipping", vbe_pages);
+        kdebug("allocated backbuffer at 0x%x and shadow buffer at 0x%x", vbe_fbuf_impl.backbuffer, vbe_shadow);
+        memset(vbe_fbuf_impl.backbuffer, 0, fb_size); memset(vbe_shadow, 0, fb_size);
+        vbe_force_flip(0, vbe_fbuf_impl.height); // VRAM contents are unknown until each page's first flip
+        vbe_fbuf_impl.flip = &vbe_flip_pages;
+        vbe_fbuf_impl.scroll_up = NULL; vbe_fbuf_impl.scroll_down = NULL; // Y offset is ours now
+        vbe_fbuf_impl.tick_flip = timer_tick;
+        vbe_fbuf_impl.flip_all = true; // our flip handler finds the damaged lines by itself, and does nothing if there are none
+        vbe_fbuf_impl.dbuf_direct_write = false; // drawing only touches RAM
+    } else if(vbe_fbuf_impl.backbuffer != NULL) {
+        kdebug("allocated backbuffer at 0x%x and shadow buffer at 0x%x", vbe_fbuf_impl.backbuffer, vbe_shadow);
+        memset(vbe_fbuf_impl.backbuffer, 0, fb_size); memset(vbe_shadow, 0, fb_size);
+        vbe_force_flip(0, vbe_fbuf_impl.height); // VRAM contents are unknown until the first flip
+
+        /* use as much VRAM as possible for the scrolling ring */
+        size_t virt_height = vbe_fbuf_size / vbe_fbuf_impl.pitch;
+        if(virt_height > 0xFFFF) virt_height = 0xFFFF; // DISPI registers are 16-bit
+        if(virt_height >= 2 * vbe_fbuf_impl.height) { // a shorter ring would have screen lines sharing ring lines
+            vbe_ring_lines = virt_height - vbe_fbuf_impl.height;
+            kdebug("using %u-line VRAM ring for scrolling", vbe_ring_lines);
+        } else kwarn("not enough VRAM for hardware scrolling");
+        vbe_fbuf_impl.flip = &vbe_flip;
+        vbe_fbuf_impl.tick_flip = timer_tick;
+        vbe_fbuf_impl.flip_all = true; // our flip handler finds the damaged spans by itself
+        vbe_fbuf_impl.dbuf_direct_write = false; // drawing only touches RAM
+    } else kerror("cannot allocate backbuffer - double buffering will be unavailable");
+
     mutex_acquire(&vbe_devtree_node->header.in_use); // lock device for exclusive use
+    vbe_dispi_map(vbe_id); // nothing can fail from here on, so there's no need to unmap on error
 
     /* set video mode */
     kinfo("setting video mode to %ux%ux%u", mode_w, mode_h, mode_bpp);
@@ -147,12 +380,15 @@ int32_t kmod_init(elf_prgload_t* load_result, size_t load_result_len) {
     vbe_write_reg(VBE_DISPI_INDEX_YRES, mode_h);
     vbe_write_reg(VBE_DISPI_INDEX_BPP, mode_bpp);
     vbe_write_reg(VBE_DISPI_INDEX_VIRT_WIDTH, mode_w);
+    if(vbe_pages > 1) vbe_write_reg(VBE_DISPI_INDEX_VIRT_HEIGHT, mode_h * vbe_pages);
+    else if(vbe_ring_lines) vbe_write_reg(VBE_DISPI_INDEX_VIRT_HEIGHT, vbe_ring_lines + mode_h);
     vbe_write_reg(VBE_DISPI_INDEX_X_OFFSET, 0);
     vbe_write_reg(VBE_DISPI_INDEX_Y_OFFSET, 0); // TODO: accelerated scrolling
     vbe_write_reg(VBE_DISPI_INDEX_ENABLE, VBE_DISPI_ENABLED | VBE_DISPI_LFB_ENABLED);
     
     fbuf_impl = &vbe_fbuf_impl;
     term_impl = &fbterm_hook;
+    fbdev_register(&vbe_fbuf_impl);
 
     kinfo("Bochs Graphics Adapter initialized successfully");
 
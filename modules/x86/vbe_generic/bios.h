@@ -87,6 +87,22 @@ static vbe_modeinfo_t* vbe_get_modeinfo(uint16_t mode) {
     return NULL;
 }
 
+/*
+ * static uintptr_t vbe_get_pmi(size_t* len)
+ *  Locates the VBE 2.0+ protected mode interface table (function 4F0A).
+ *  The table starts with 16-bit offsets of the protected mode 4F05, 4F07 and 4F09
+ *  routines, followed by the offset of the I/O port/memory list (0 if there's none).
+ *  Returns the table's physical address, or 0 if it is not available.
+ */
+static uintptr_t vbe_get_pmi(size_t* len) {
+    int32_regs_t regs; memset(&regs, 0, sizeof(int32_regs_t));
+    regs.ax = 0x4F0A; regs.bx = 0;
+    int32(0x10, &regs);
+    if(regs.ax != 0x004F) return 0;
+    *len = regs.cx;
+    return VBE_LINEAR_ADDR((uintptr_t) regs.es, (uintptr_t) regs.di);
+}
+
 static bool vbe_set_mode(uint16_t mode) {
     int32_regs_t regs; memset(&regs, 0, sizeof(int32_regs_t));
     regs.ax = 0x4F02; regs.bx = mode | 0x4000; // use LFB
@@ -5,14 +5,25 @@
 #include <stdlib.h>
 #include <hal/fbuf.h>
 #include <hal/timer.h>
+#define FBMEM_IMPL
+#include <fbmem.h>
+#include <fbdev.h>
+#include <fballoc.h>
 #include "bios.h"
 
 /* default (fallback) resolution */
 #define VBE_FALLBACK_WIDTH                      640
 #define VBE_FALLBACK_HEIGHT                     480
 
+#define VBE_RING_SCREENS                        4 // maximum amount of VRAM to map for the scrolling ring, in screens
+
+/* video mode flags */
+#define VBE_MODE_QUERIED                        (1 << 0) // mode information has been read from the BIOS
+#define VBE_MODE_USABLE                         (1 << 1) // mode has a LFB and more than 8 BPP
+
 typedef struct {
     uint16_t mode;
+    uint8_t flags; // VBE_MODE_*
     uint16_t width;
     uint16_t height;
     uint8_t bpp;
@@ -20,22 +31,88 @@ typedef struct {
     uintptr_t framebuffer_ptr;
 } vbe_mode_t;
 
+/* resolutions of the standard VESA mode numbers, indexed by mode - 0x100 (0 = text mode) */
+static const uint16_t vbe_std_modes[][2] = {
+    {640, 400}, {640, 480}, {800, 600}, {800, 600}, {1024, 768}, {1024, 768}, {1280, 1024}, {1280, 1024}, // 0x100-0x107
+    {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, // 0x108-0x10C
+    {320, 200}, {320, 200}, {320, 200}, // 0x10D-0x10F
+    {640, 480}, {640, 480}, {640, 480}, {800, 600}, {800, 600}, {800, 600}, // 0x110-0x115
+    {1024, 768}, {1024, 768}, {1024, 768}, {1280, 1024}, {1280, 1024}, {1280, 1024} // 0x116-0x11B
+};
+#define VBE_STD_MODES_NUM                       (sizeof(vbe_std_modes) / sizeof(vbe_std_modes[0]))
+static bool vbe_std_modes_trusted = false; // VBE 2.0 dropped the fixed mode numbers, so the table is only a hint on older BIOSes
+
 static vbe_mode_t* vbe_modes = NULL; // list of video modes
 static size_t vbe_modes_len = 0;
+static size_t vbe_modes_queried = 0; // number of modes we had to ask the BIOS about
 static vbe_mode_t* vbe_mode_current = NULL; // current video mode
 static void* vbe_framebuffer = NULL;
+static size_t vbe_vram_size = 0; // size of the video memory mapping at vbe_framebuffer
+static void* vbe_shadow = NULL; // last flipped backbuffer contents
+static size_t vbe_force_y1 = 0, vbe_force_y2 = 0; // range of lines to be flipped regardless of the shadow
+
+/* protected mode interface */
+static void* vbe_pmi = NULL; // copy of the BIOS's protected mode interface table (which contains the code too)
+static void* vbe_pm_set_start = NULL; // set display start (4F07) routine in vbe_pmi, NULL if unavailable
+
+/*
+ * VRAM ring for hardware scrolling, laid out like in vbe_bochs: VRAM holds vbe_ring_lines lines followed by
+ * a mirror of the first (screen height) lines, so the visible window starting at any ring line is contiguous;
+ * screen line y lives at ring line (vbe_ring_origin + y) % vbe_ring_lines
+ */
+static size_t vbe_ring_lines = 0; // 0 if hardware scrolling is unavailable
+static size_t vbe_ring_origin = 0; // ring line at the top of the screen (i.e. display start)
 
 static fbuf_t vbe_fbuf_impl;
 
+/*
+ * static bool vbe_query_mode(vbe_mode_t* mode)
+ *  Reads information on the specified mode from the BIOS if it hasn't been done yet.
+ *  Returns whether the mode can be used by this driver.
+ */
+static bool vbe_query_mode(vbe_mode_t* mode) {
+    if(mode->flags & VBE_MODE_QUERIED) return (mode->flags & VBE_MODE_USABLE);
+    mode->flags = VBE_MODE_QUERIED; vbe_modes_queried++;
+
+    vbe_modeinfo_t* info = vbe_get_modeinfo(mode->mode);
+    if(info == NULL) {
+        kerror("cannot get information on video mode 0x%x", mode->mode);
+        return false;
+    }
+    if(!(info->attribs & (1 << 7))) {
+        kwarn("skipping mode 0x%x since LFB is not supported", mode->mode);
+        return false;
+    }
+    if(info->bpp <= 8) {
+        kwarn("skipping mode 0x%x due to low BPP", mode->mode);
+        return false;
+    }
+    mode->width = info->width; mode->height = info->height; mode->bpp = info->bpp; mode->pitch = info->pitch; mode->framebuffer_ptr = info->framebuffer;
+    mode->flags |= VBE_MODE_USABLE;
+    // kdebug("mode 0x%x: %ux%ux%u, framebuffer ptr 0x%x (%u bytes)", mode->mode, mode->width, mode->height, mode->bpp, mode->framebuffer_ptr, mode->pitch * mode->height);
+    return true;
+}
+
+/* checks if a mode may have the specified resolution without asking the BIOS */
+static bool vbe_mode_candidate(vbe_mode_t* mode, size_t width, size_t height, bool use_std) {
+    if(mode->flags & VBE_MODE_QUERIED) return (mode->width == width && mode->height == height);
+    if(!use_std) return true;
+    if(mode->mode < 0x100 || (size_t) (mode->mode - 0x100) >= VBE_STD_MODES_NUM) return true; // OEM mode - we can't tell
+    return (vbe_std_modes[mode->mode - 0x100][0] == width && vbe_std_modes[mode->mode - 0x100][1] == height);
+}
+
 static vbe_mode_t* vbe_find_mode(size_t width, size_t height, size_t bpp) {
     size_t idx = (size_t)-1; // index of most suitable mode
-    for(size_t i = 0; i < vbe_modes_len; i++) {
-        if(vbe_modes[i].width == width && vbe_modes[i].height == height && (!bpp || vbe_modes[i].bpp == bpp)) {
-            if(idx == (size_t)-1) idx = i;
-            if(bpp) { // chosen one right here
-                idx = i;
-                break;
-            } else if(vbe_modes[i].bpp != 24 && vbe_modes[i].bpp > vbe_modes[idx].bpp) idx = i; // skip 24bpp modes to avoid performance impact
+    for(size_t pass = (vbe_std_modes_trusted) ? 0 : 1; pass < 2 && idx == (size_t)-1; pass++) { // if the standard mode table turns out to be wrong, query every mode
+        for(size_t i = 0; i < vbe_modes_len; i++) {
+            if(!vbe_mode_candidate(&vbe_modes[i], width, height, (pass == 0)) || !vbe_query_mode(&vbe_modes[i])) continue;
+            if(vbe_modes[i].width == width && vbe_modes[i].height == height && (!bpp || vbe_modes[i].bpp == bpp)) {
+                if(idx == (size_t)-1) idx = i;
+                if(bpp) { // chosen one right here
+                    idx = i;
+                    break;
+                } else if(vbe_modes[i].bpp != 24 && vbe_modes[i].bpp > vbe_modes[idx].bpp) idx = i; // skip 24bpp modes since they need conversion on flip
+            }
         }
     }
     
@@ -46,13 +123,187 @@ static vbe_mode_t* vbe_find_mode(size_t width, size_t height, size_t bpp) {
     } else return &vbe_modes[idx];
 }
 
+static void vbe_force_flip(size_t y1, size_t y2) {
+    if(vbe_force_y1 == vbe_force_y2) {
+        vbe_force_y1 = y1; vbe_force_y2 = y2;
+    } else {
+        if(y1 < vbe_force_y1) vbe_force_y1 = y1;
+        if(y2 > vbe_force_y2) vbe_force_y2 = y2;
+    }
+}
+
+/* returns the VRAM address of screen line y, and that of its mirror in the ring (or NULL) */
+static uint8_t* vbe_vram_line(size_t y, uint8_t** mirror) {
+    *mirror = NULL;
+    if(!vbe_ring_lines) return (uint8_t*) vbe_framebuffer + y * vbe_mode_current->pitch;
+    size_t line = (vbe_ring_origin + y) % vbe_ring_lines;
+    if(line < vbe_mode_current->height) *mirror = (uint8_t*) vbe_framebuffer + (line + vbe_ring_lines) * vbe_mode_current->pitch;
+    return (uint8_t*) vbe_framebuffer + line * vbe_mode_current->pitch;
+}
+
+/*
+ * static void vbe_flip(fbuf_t* impl)
+ *  Copies the changed parts of the backbuffer to the framebuffer.
+ *  Each line is compared against the shadow copy, and only the span between the
+ *  first and last changed dwords is written to video memory.
+ */
+static void vbe_flip(fbuf_t* impl) {
+    size_t words = (impl->width * ((vbe_mode_current->bpp + 7) >> 3) + 3) >> 2; // visible part of each line (padding is never drawn to)
+    size_t flipped = 0;
+    for(size_t y = 0; y < impl->height; y++) {
+        uint32_t* line = (uint32_t*) ((uintptr_t) impl->backbuffer + y * impl->pitch);
+        uint32_t* shadow_line = (uint32_t*) ((uintptr_t) vbe_shadow + y * impl->pitch);
+        size_t x1 = 0, x2 = words;
+        if((y < vbe_force_y1 || y >= vbe_force_y2) && !fbmem_diff32(line, shadow_line, words, &x1, &x2)) continue;
+        uint8_t* mirror; uint8_t* dst = vbe_vram_line(y, &mirror);
+        fbmem_copy_vram(&dst[x1 * 4], &line[x1], (x2 - x1) * 4);
+        if(mirror != NULL) fbmem_copy_vram(&mirror[x1 * 4], &line[x1], (x2 - x1) * 4);
+        memcpy(&shadow_line[x1], &line[x1], (x2 - x1) * 4);
+        flipped += (x2 - x1) * 4;
+    }
+    vbe_force_y1 = vbe_force_y2 = 0;
+    fbdev_flip_account(flipped);
+}
+
+/*
+ * static void vbe_flip_24(fbuf_t* impl)
+ *  Packs the changed parts of the 32bpp backbuffer into the 24bpp framebuffer.
+ *  Each line is compared against the shadow copy, and only the span between the
+ *  first and last changed pixels (rounded out to 4-pixel groups) is converted.
+ */
+static void vbe_flip_24(fbuf_t* impl) {
+    size_t flipped = 0;
+    for(size_t y = 0; y < impl->height; y++) {
+        uint32_t* line = (uint32_t*) ((uintptr_t) impl->backbuffer + y * impl->pitch);
+        uint32_t* shadow_line = (uint32_t*) ((uintptr_t) vbe_shadow + y * impl->pitch);
+        size_t x1 = 0, x2 = impl->width;
+        if((y < vbe_force_y1 || y >= vbe_force_y2) && !fbmem_diff32(line, shadow_line, impl->width, &x1, &x2)) continue;
+        x1 &= ~3; x2 = (x2 + 3) & ~3; if(x2 > impl->width) x2 = impl->width; // keep VRAM writes dword aligned
+        uint8_t* mirror; uint8_t* dst = vbe_vram_line(y, &mirror);
+        fbpix_ops_bgr888.convert(&dst[x1 * 3], &line[x1], x2 - x1);
+        if(mirror != NULL) fbpix_ops_bgr888.convert(&mirror[x1 * 3], &line[x1], x2 - x1);
+        memcpy(&shadow_line[x1], &line[x1], (x2 - x1) * 4);
+        flipped += (x2 - x1) * 3;
+    }
+    vbe_force_y1 = vbe_force_y2 = 0;
+    fbdev_flip_account(flipped);
+}
+
+/* sets the display start to the specified VRAM line through the protected mode interface */
+static void vbe_set_start(size_t line) {
+    uint32_t offset = (line * vbe_mode_current->pitch) >> 2; // in units of 4 bytes
+    uint32_t eax = 0x4F07, ebx = 0, ecx = offset & 0xFFFF, edx = offset >> 16;
+    void* entry = vbe_pm_set_start;
+    asm volatile("call *%%esi" : "+a"(eax), "+b"(ebx), "+c"(ecx), "+d"(edx), "+S"(entry) : : "edi", "memory", "cc"); // the BIOS code may trash any of these
+}
+
+/* moves the ring origin, drawing the exposed lines into the ring while they're still off screen so that stale ring contents never get displayed */
+static void vbe_ring_scroll(fbuf_t* impl, size_t lines, bool up) {
+    lines %= vbe_ring_lines;
+    vbe_ring_origin = (vbe_ring_origin + ((up) ? lines : (vbe_ring_lines - lines))) % vbe_ring_lines;
+
+    bool packed = (impl->flip == &vbe_flip_24);
+    size_t len = (packed) ? (impl->width * 3) : (((impl->width * ((vbe_mode_current->bpp + 7) >> 3) + 3) >> 2) << 2); // bytes written to VRAM per line
+    for(size_t y = vbe_force_y1; y < vbe_force_y2; y++) {
+        uint32_t* line = (uint32_t*) ((uintptr_t) impl->backbuffer + y * impl->pitch);
+        uint8_t* mirror; uint8_t* dst = vbe_vram_line(y, &mirror);
+        if(packed) {
+            fbpix_ops_bgr888.convert(dst, line, impl->width);
+            if(mirror != NULL) fbpix_ops_bgr888.convert(mirror, line, impl->width);
+        } else {
+            fbmem_copy_vram(dst, line, len);
+            if(mirror != NULL) fbmem_copy_vram(mirror, line, len);
+        }
+        memcpy((void*) ((uintptr_t) vbe_shadow + y * impl->pitch), line, impl->pitch);
+    }
+    fbdev_flip_account((vbe_force_y2 - vbe_force_y1) * len);
+    vbe_force_y1 = vbe_force_y2 = 0;
+
+    vbe_set_start(vbe_ring_origin);
+    if(impl->framebuffer != impl->backbuffer) impl->framebuffer = (void*) ((uintptr_t) vbe_framebuffer + vbe_ring_origin * vbe_mode_current->pitch); // not for 24bpp modes
+}
+
+/* scroll backbuffer and shadow, then move the ring origin - only the newly exposed lines need to be drawn */
+static void vbe_scroll_up(fbuf_t* impl, size_t lines) {
+    memmove(impl->backbuffer, (void*) ((uintptr_t) impl->backbuffer + lines * impl->pitch), impl->pitch * (impl->height - lines));
+    memmove(vbe_shadow, (void*) ((uintptr_t) vbe_shadow + lines * impl->pitch), impl->pitch * (impl->height - lines));
+    vbe_force_flip(impl->height - lines, impl->height);
+    vbe_ring_scroll(impl, lines, true);
+}
+
+static void vbe_scroll_down(fbuf_t* impl, size_t lines) {
+    memmove((void*) ((uintptr_t) impl->backbuffer + lines * impl->pitch), impl->backbuffer, impl->pitch * (impl->height - lines));
+    memmove((void*) ((uintptr_t) vbe_shadow + lines * impl->pitch), vbe_shadow, impl->pitch * (impl->height - lines));
+    vbe_force_flip(0, lines);
+    vbe_ring_scroll(impl, lines, false);
+}
+
+/*
+ * static void* vbe_pmi_load()
+ *  Copies the protected mode interface out of the BIOS into vbe_pmi.
+ *  Returns the set display start routine, or NULL if the BIOS doesn't have one that we can call.
+ */
+static void* vbe_pmi_load() {
+    size_t len;
+    uintptr_t pmi_paddr = vbe_get_pmi(&len);
+    if(!pmi_paddr || len < 4 * sizeof(uint16_t)) return NULL;
+
+    uint16_t* pmi = (uint16_t*) vmm_alloc_map(vmm_current, pmi_paddr, (pmi_paddr & 4095) + len, kernel_end, UINTPTR_MAX, 0, 0, false, VMM_FLAGS_PRESENT);
+    if(pmi == NULL) {
+        kerror("cannot map protected mode interface table");
+        return NULL;
+    }
+
+    void* ret = NULL;
+    size_t words = len / 2;
+    if(pmi[3]) {
+        /* I/O port list (we're in ring 0, so it doesn't concern us) followed by the memory list */
+        size_t i = pmi[3] / 2;
+        while(i < words && pmi[i] != 0xFFFF) i++;
+        if(i + 1 < words && pmi[i + 1] != 0xFFFF) {
+            kwarn("protected mode interface needs memory selectors - not using it");
+            goto done;
+        }
+    }
+    if(pmi[1] >= len) goto done; // 4F07 entry point outside of table
+
+    vbe_pmi = kmalloc(len);
+    if(vbe_pmi == NULL) {
+        kerror("cannot allocate memory for protected mode interface");
+        goto done;
+    }
+    memcpy(vbe_pmi, pmi, len);
+    kdebug("protected mode interface loaded at 0x%x (%u bytes)", vbe_pmi, len);
+    ret = (void*) ((uintptr_t) vbe_pmi + pmi[1]);
+
+done:
+    vmm_unmap(vmm_current, (uintptr_t) pmi & ~4095, ((uintptr_t) pmi & 4095) + len);
+    return ret;
+}
+
+/* unmaps the framebuffer and frees the protected mode interface and the backbuffer/shadow (of buf_size bytes each) */
+static void vbe_free_resources(size_t buf_size) {
+    if(vbe_framebuffer != NULL) vmm_unmap(vmm_kernel, (uintptr_t) vbe_framebuffer, vbe_vram_size); // unmap framebuffer from memory
+    vbe_framebuffer = NULL;
+    if(vbe_pmi != NULL) kfree(vbe_pmi);
+    vbe_pmi = NULL; vbe_pm_set_start = NULL;
+    if(vbe_shadow != NULL) {
+        /* the backbuffer is ours too */
+        fballoc_free(vbe_fbuf_impl.backbuffer, buf_size);
+        fballoc_free(vbe_shadow, buf_size);
+    }
+    vbe_fbuf_impl.backbuffer = NULL; vbe_shadow = NULL;
+}
+
 static bool vbe_unload_handler(fbuf_t* impl) {
-    vmm_unmap(vmm_kernel, (uintptr_t) impl->framebuffer, impl->pitch * impl->height); // unmap framebuffer from memory
+    if(!fbdev_unregister()) return false; // buffers are still in use by userland
+    vbe_free_resources(impl->pitch * impl->height);
     return true;
 }
 
 int32_t kmod_init(elf_prgload_t* load_result, size_t load_result_len) {
     kinfo("Generic VESA BIOS Extensions driver for SysX");
+    fbmem_init();
 
     /* check if cmdline specifies that the kernel will use this driver */
     const char* fbdrv_override = cmdline_find_kvp("fbdrv");
@@ -81,6 +332,8 @@ int32_t kmod_init(elf_prgload_t* load_result, size_t load_result_len) {
         kerror("VBE is not supported");
         return -1;
     } else kinfo("video card supports VBE %u.%u, VRAM size: %uK", ctrlinfo->ver_maj, ctrlinfo->ver_min, ctrlinfo->memory * 64);
+    uint8_t vbe_ver = ctrlinfo->ver_maj; size_t vram_total = ctrlinfo->memory * 65536; // ctrlinfo will be overwritten by later calls
+    vbe_std_modes_trusted = (vbe_ver < 2);
 
     /* parse video modes list */
     kdebug("discovering video modes");
@@ -109,37 +362,13 @@ int32_t kmod_init(elf_prgload_t* load_result, size_t load_result_len) {
     for(size_t i = 0; i < vbe_modes_len; i++) vbe_modes[i].mode = modes[i]; // copy mode numbers over
     if(map) vmm_pgunmap(vmm_current, (uintptr_t) modes, 0); // unmap the video modes list
 
-    /* get information on each mode */
-    for(size_t i = 0; i < vbe_modes_len; i++) {
-        vbe_modeinfo_t* mode = vbe_get_modeinfo(vbe_modes[i].mode);
-        if(mode == NULL) {
-            kerror("cannot get information on video mode 0x%x", vbe_modes[i].mode);
-            goto shrink;
-        }
-        if(!(mode->attribs & (1 << 7))) {
-            kwarn("skipping mode 0x%x since LFB is not supported", vbe_modes[i].mode);
-            goto shrink;
-        }
-        if(mode->bpp <= 8) {
-            kwarn("skipping mode 0x%x due to low BPP", vbe_modes[i].mode);
-            goto shrink;
-        }
-        vbe_modes[i].width = mode->width; vbe_modes[i].height = mode->height; vbe_modes[i].bpp = mode->bpp; vbe_modes[i].pitch = mode->pitch; vbe_modes[i].framebuffer_ptr = mode->framebuffer;
-        // kdebug("mode 0x%x: %ux%ux%u, framebuffer ptr 0x%x (%u bytes)", vbe_modes[i].mode, vbe_modes[i].width, vbe_modes[i].height, vbe_modes[i].bpp, vbe_modes[i].framebuffer_ptr, vbe_modes[i].pitch * vbe_modes[i].height);
-        continue;
-shrink: 
-        if(i != vbe_modes_len - 1) memmove(&vbe_modes[i], &vbe_modes[i + 1], (vbe_modes_len - i - 1) * sizeof(vbe_mode_t));
-        vbe_modes_len--; i--; vbe_modes = krealloc(vbe_modes, vbe_modes_len * sizeof(vbe_mode_t));
-    }
-    kdebug("found %u usable video mode(s)", vbe_modes_len);
-
     /* check for video mode override in cmdline */
     const char* mode_override = cmdline_find_kvp("vbe_mode");
     if(mode_override != NULL) {
         uint16_t mode = strtoul(mode_override, NULL, 16);
         for(size_t i = 0; i < vbe_modes_len; i++) {
             if(vbe_modes[i].mode == mode) {
-                vbe_mode_current = &vbe_modes[i];
+                if(vbe_query_mode(&vbe_modes[i])) vbe_mode_current = &vbe_modes[i];
                 break;
             }
         }
@@ -168,42 +397,58 @@ shrink:
         }   
     }
 
-    if(vbe_mode_current->bpp == 24) kwarn("using 24 BPP video mode - expect performance impacts");
+    kdebug("queried %u out of %u video mode(s)", vbe_modes_queried, vbe_modes_len);
+    if(vbe_mode_current->bpp == 24) kinfo("using 24 BPP video mode - drawing will be done at 32 BPP and converted on flip");
 
-    /* find virtual address space for framebuffer */
+    /* check for hardware scrolling support through the protected mode interface */
     size_t fb_size = vbe_mode_current->pitch * vbe_mode_current->height;
-    vbe_framebuffer = (void*) vmm_alloc_map(vmm_current, vbe_mode_current->framebuffer_ptr, fb_size, kernel_end, UINTPTR_MAX, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_CACHE | VMM_FLAGS_GLOBAL); // writeback cache
+    vbe_vram_size = fb_size;
+    if(vbe_ver >= 2 && !(vbe_mode_current->pitch & 3)) {
+        size_t vram_lines = vram_total / vbe_mode_current->pitch;
+        if(vram_lines > VBE_RING_SCREENS * vbe_mode_current->height) vram_lines = VBE_RING_SCREENS * vbe_mode_current->height; // don't map all of a large card's VRAM
+        if(vram_lines >= 2 * vbe_mode_current->height) {
+            vbe_pm_set_start = vbe_pmi_load();
+            if(vbe_pm_set_start != NULL) {
+                /* use the rest of the VRAM we're mapping for the scrolling ring */
+                vbe_ring_lines = vram_lines - vbe_mode_current->height;
+                vbe_vram_size = vram_lines * vbe_mode_current->pitch;
+            } else kdebug("protected mode interface is not available - hardware scrolling disabled");
+        } else kwarn("not enough VRAM for hardware scrolling");
+    }
+
+    /* find virtual address space for framebuffer */
+    vbe_framebuffer = (void*) vmm_alloc_map(vmm_current, vbe_mode_current->framebuffer_ptr, vbe_vram_size, kernel_end, UINTPTR_MAX, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_CACHE | VMM_FLAGS_GLOBAL); // writeback cache
     if(vbe_framebuffer == NULL) {
         kerror("cannot find virtual address space for framebuffer");
+        vbe_free_resources(0); // only the protected mode interface has been loaded so far
         kfree(vbe_modes);
         vmm_pgunmap(vmm_current, VBE_DATA_VADDR, 0);
         return -5;
-    } else kdebug("mapped framebuffer at paddr 0x%x to 0x%x, size: %u bytes", vbe_mode_current->framebuffer_ptr, vbe_framebuffer, fb_size);
+    } else kdebug("mapped framebuffer at paddr 0x%x to 0x%x, size: %u bytes", vbe_mode_current->framebuffer_ptr, vbe_framebuffer, vbe_vram_size);
 
-    /* allocate memory for backbuffer */
+    /* allocate memory for backbuffer and its shadow */
     vbe_fbuf_impl.flip = NULL;
-    vbe_fbuf_impl.backbuffer = (void*) vmm_first_free(vmm_kernel, kernel_end, UINTPTR_MAX, fb_size, 0, false);
+    size_t buf_size = (vbe_mode_current->bpp == 24) ? (vbe_mode_current->width * 4 * vbe_mode_current->height) : fb_size; // 24bpp modes are drawn at 32bpp so the kernel never sees 3-byte pixels
+    vbe_fbuf_impl.backbuffer = fballoc_alloc(buf_size);
     if(vbe_fbuf_impl.backbuffer != NULL) {
-        for(size_t off = 0; off < fb_size; off += 4096) {
-            size_t frame = pmm_alloc_free(1);
-            if(frame == (size_t)-1) {
-                kerror("cannot allocate physical frame for backbuffer - double buffering will be unavailable");
-                for(size_t off2 = 0; off2 < off; off2 += 4096) {
-                    pmm_free(vmm_get_paddr(vmm_kernel, (uintptr_t) vbe_fbuf_impl.backbuffer + off2) >> 12);
-                    vmm_pgunmap(vmm_kernel, (uintptr_t) vbe_fbuf_impl.backbuffer + off2, 0);
-                }
-                vbe_fbuf_impl.backbuffer = NULL;
-            }
-            vmm_pgmap(vmm_kernel, frame << 12, (uintptr_t) vbe_fbuf_impl.backbuffer + off, 0, VMM_FLAGS_PRESENT | VMM_FLAGS_GLOBAL | VMM_FLAGS_CACHE | VMM_FLAGS_RW);
+        vbe_shadow = fballoc_alloc(buf_size);
+        if(vbe_shadow == NULL) {
+            fballoc_free(vbe_fbuf_impl.backbuffer, buf_size);
+            vbe_fbuf_impl.backbuffer = NULL;
         }
-        kdebug("allocated backbuffer at 0x%x", vbe_fbuf_impl.backbuffer);
-    } else kerror("cannot allocate virtual address space for backbuffer - double buffering will be unavailable");
+    }
+    if(vbe_shadow == NULL) {
+        kerror("cannot allocate backbuffer - double buffering will be unavailable");
+        vbe_ring_lines = 0; // the ring is only maintained by our flip handlers
+    } else kdebug("allocated backbuffer at 0x%x, shadow at 0x%x", vbe_fbuf_impl.backbuffer, vbe_shadow);
+    if(vbe_ring_lines) kdebug("using %u-line VRAM ring for scrolling", vbe_ring_lines);
 
     /* set video mode */
     kinfo("setting video mode to 0x%x (%ux%ux%u)", vbe_mode_current->mode, vbe_mode_current->width, vbe_mode_current->height, vbe_mode_current->bpp);
     // kdebug("setting video mode to 0x%x (%ux%ux%u)", vbe_mode_current->mode, vbe_mode_current->width, vbe_mode_current->height, vbe_mode_current->bpp);
     if(!vbe_set_mode(vbe_mode_current->mode)) {
         kerror("setting video mode failed");
+        vbe_free_resources(buf_size);
         kfree(vbe_modes);
         vmm_pgunmap(vmm_current, VBE_DATA_VADDR, 0);
         return -6;
@@ -217,21 +462,37 @@ shrink:
         case 32: vbe_fbuf_impl.type = FBUF_32BPP_RGB888; break;
     }
     vbe_fbuf_impl.framebuffer = vbe_framebuffer;
-    vbe_fbuf_impl.scroll_up = NULL; vbe_fbuf_impl.scroll_down = NULL;
+    if(vbe_shadow != NULL) {
+        vbe_fbuf_impl.flip = &vbe_flip;
+        if(vbe_mode_current->bpp == 24) {
+            /* present the backbuffer as a 32bpp framebuffer; vbe_flip_24 does the packing */
+            vbe_fbuf_impl.type = FBUF_32BPP_RGB888; vbe_fbuf_impl.pitch = vbe_fbuf_impl.width * 4;
+            vbe_fbuf_impl.framebuffer = vbe_fbuf_impl.backbuffer; // direct writes must not reach VRAM either
+            vbe_fbuf_impl.flip = &vbe_flip_24;
+        }
+    }
+    if(vbe_ring_lines) {
+        vbe_fbuf_impl.scroll_up = &vbe_scroll_up; vbe_fbuf_impl.scroll_down = &vbe_scroll_down;
+    } else {
+        vbe_fbuf_impl.scroll_up = NULL; vbe_fbuf_impl.scroll_down = NULL;
+    }
 
     vbe_fbuf_impl.elf_segments = load_result; vbe_fbuf_impl.num_elf_segments = load_result_len;
     vbe_fbuf_impl.unload = &vbe_unload_handler;
 
     if(vbe_fbuf_impl.backbuffer != NULL) {
         /* clear backbuffer - this will be updated to the framebuffer on the next refresh */
-        memset(vbe_fbuf_impl.backbuffer, 0, fb_size);
+        fbmem_fill32(vbe_fbuf_impl.backbuffer, 0, vbe_fbuf_impl.pitch * vbe_fbuf_impl.height / 4);
         vbe_fbuf_impl.tick_flip = timer_tick;
         vbe_fbuf_impl.flip_all = true; // update changes to framebuffer later
-        vbe_fbuf_impl.dbuf_direct_write = true;
-    } else memset(vbe_fbuf_impl.framebuffer, 0, fb_size); // clear framebuffer only
+        vbe_fbuf_impl.dbuf_direct_write = false; // our flip handlers only pick up changes made to the backbuffer
+        fbmem_fill32(vbe_shadow, 0, vbe_fbuf_impl.pitch * vbe_fbuf_impl.height / 4); // in sync with the backbuffer...
+        fbmem_fill32_vram(vbe_framebuffer, 0, vbe_vram_size / 4); // ...and the screen (including the ring)
+    } else fbmem_fill32_vram(vbe_fbuf_impl.framebuffer, 0, fb_size / 4); // clear framebuffer only
 
     fbuf_impl = &vbe_fbuf_impl;
     term_impl = &fbterm_hook;
+    fbdev_register(&vbe_fbuf_impl);
 
     vmm_pgunmap(vmm_current, VBE_DATA_VADDR, 0);
     return 0;